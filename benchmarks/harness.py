@@ -0,0 +1,185 @@
+"""Performance regression harness of the ``core.Matrix`` bindings.
+
+Usage: python benchmarks/harness.py [--path BUILD_DIR] [--output FILE]
+
+BUILD_DIR is the directory containing the compiled ``core`` module.
+
+Times ``set``, ``get``, ``__getitem__`` and ``__setitem__`` on matrices whose
+entries are spread uniformly, along power-law rows (a few rows holding most of
+the entries) or along a band around the diagonal. Each case runs in its own
+process so that its peak resident memory can be measured. The results are
+written as JSON: for each case, the throughput (operations per second), the
+bytes used per stored entry and the peak RSS in bytes. Compare two result
+files with ``--compare BASELINE`` to list the regressions.
+"""
+import argparse
+import json
+import multiprocessing
+import os
+import platform
+import resource
+import sys
+import time
+
+import numpy as np
+
+LAYOUTS = ("uniform", "power-law", "banded")
+OPERATIONS = ("set", "get", "getitem", "setitem")
+
+
+def import_core(path):
+    if path is not None:
+        sys.path.insert(0, path)
+    try:
+        from sparse import core
+    except ImportError:
+        import core
+    return core
+
+
+def make_entries(layout, size, nnz, rng):
+    """Coordinates of ``nnz`` entries of a ``size`` x ``size`` matrix."""
+    j = rng.integers(0, size, nnz, dtype=np.uint32)
+    if layout == "uniform":
+        i = rng.integers(0, size, nnz, dtype=np.uint32)
+    elif layout == "power-law":
+        i = np.minimum(rng.zipf(1.1, nnz) - 1, size - 1).astype(np.uint32)
+    else:
+        i = np.clip(j.astype(np.int64) + rng.integers(-64, 65, nnz), 0,
+                    size - 1).astype(np.uint32)
+    return i, j, rng.random(nnz)
+
+
+def peak_rss():
+    """Peak resident memory of the process in bytes."""
+    usage = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Kilobytes on Linux, bytes on macOS.
+    return usage if sys.platform == "darwin" else usage * 1024
+
+
+def best_of(repeat, stmt):
+    """Shortest time of ``repeat`` calls of ``stmt``."""
+    result = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        stmt()
+        result = min(result, time.perf_counter() - start)
+    return result
+
+
+def run_case(args, layout, operation):
+    core = import_core(args.path)
+    rng = np.random.default_rng(0)
+    i, j, x = make_entries(layout, args.size, args.nnz, rng)
+    m = core.Matrix()
+    m.set(i, j, x)
+    window = (slice(0, args.window), slice(0, args.window))
+
+    if operation == "set":
+        def stmt():
+            core.Matrix().set(i, j, x)
+        ops = args.nnz
+    elif operation == "get":
+        key = (slice(0, args.window), slice(0, args.size))
+
+        def stmt():
+            m.get(key)
+        ops = args.window * args.size
+    elif operation == "getitem":
+        def stmt():
+            m[window]
+        ops = args.window * args.window
+    else:
+        block = m[window]
+
+        def stmt():
+            m[window] = block
+        ops = args.window * args.window
+
+    elapsed = best_of(args.repeat, stmt)
+    return {
+        "layout": layout,
+        "operation": operation,
+        "shape": [args.size, args.size],
+        "nnz": m.nnz,
+        "ops": ops,
+        "seconds": elapsed,
+        "ops_per_second": ops / elapsed,
+        "bytes_per_nnz": m.nbytes / max(m.nnz, 1),
+        "peak_rss": peak_rss(),
+    }
+
+
+def compare(results, baseline, tolerance):
+    """Lists the cases slower than in ``baseline`` by more than
+    ``tolerance``."""
+    reference = {(item["layout"], item["operation"]): item
+                 for item in baseline["results"]}
+    regressions = []
+    for item in results["results"]:
+        base = reference.get((item["layout"], item["operation"]))
+        if base is None:
+            continue
+        ratio = item["ops_per_second"] / base["ops_per_second"]
+        if ratio < 1 - tolerance:
+            regressions.append(
+                f"{item['operation']:8s} {item['layout']:10s} "
+                f"{ratio:6.2f}x the baseline throughput")
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--path", help="directory of the core module")
+    parser.add_argument("--size", type=int, default=1 << 20)
+    parser.add_argument("--nnz", type=int, default=1 << 22)
+    parser.add_argument("--window", type=int, default=2048)
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--layout", choices=LAYOUTS, nargs="+",
+                        default=list(LAYOUTS))
+    parser.add_argument("--operation", choices=OPERATIONS, nargs="+",
+                        default=list(OPERATIONS))
+    parser.add_argument("--output", help="JSON file of the results")
+    parser.add_argument("--compare", help="JSON file of baseline results")
+    parser.add_argument("--tolerance", type=float, default=0.1,
+                        help="relative slowdown reported as a regression")
+    args = parser.parse_args()
+
+    cases = [(layout, operation) for layout in args.layout
+             for operation in args.operation]
+    context = multiprocessing.get_context("spawn")
+    with context.Pool(1, maxtasksperchild=1) as pool:
+        results = [
+            pool.apply(run_case, (args, layout, operation))
+            for layout, operation in cases
+        ]
+
+    document = {
+        "context": {
+            "python": platform.python_version(),
+            "numpy": np.__version__,
+            "machine": platform.machine(),
+            "system": platform.system(),
+            "cpus": os.cpu_count(),
+            "date": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        },
+        "results": results,
+    }
+    text = json.dumps(document, indent=2)
+    if args.output:
+        with open(args.output, "w") as stream:
+            stream.write(text + "\n")
+    else:
+        print(text)
+
+    if args.compare:
+        with open(args.compare) as stream:
+            regressions = compare(document, json.load(stream), args.tolerance)
+        for item in regressions:
+            print(item, file=sys.stderr)
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
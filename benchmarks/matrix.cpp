@@ -0,0 +1,175 @@
+// Benchmarks of Matrix::set and Matrix::get.
+//
+// Usage: bench [--benchmark_format=json] [--benchmark_out=FILE]
+//
+// Each benchmark is run for three layouts of the entries in a square matrix:
+// uniform, power-law rows (a few rows holding most of the entries) and banded
+// (entries close to the diagonal). Besides the throughput, the benchmarks of
+// "set" report the bytes used per stored entry.
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include "sparse.hpp"
+
+enum Layout : int64_t { kUniform, kPowerLaw, kBanded };
+
+// Size of the rows and columns of the benchmarked matrices.
+constexpr uint32_t kSize = 1 << 20;
+
+// Coordinates of "n" entries.
+struct Entries {
+  std::vector<uint32_t> i;
+  std::vector<uint32_t> j;
+  std::vector<double> x;
+};
+
+auto make_entries(const Layout layout, const size_t n) -> Entries {
+  auto generator = std::mt19937_64(0);
+  auto uniform = std::uniform_int_distribution<uint32_t>(0, kSize - 1);
+  // Zipf-like row indices: the index is the floor of a Pareto variable.
+  auto pareto = std::uniform_real_distribution<double>(0, 1);
+  auto band = std::uniform_int_distribution<int64_t>(-64, 64);
+  auto result = Entries();
+  result.i.resize(n);
+  result.j.resize(n);
+  result.x.resize(n);
+  for (size_t ix = 0; ix < n; ++ix) {
+    auto j = uniform(generator);
+    auto i = j;
+    switch (layout) {
+      case kUniform:
+        i = uniform(generator);
+        break;
+      case kPowerLaw:
+        i = static_cast<uint32_t>(
+            std::min(std::pow(1 - pareto(generator), -1.0 / 1.1) - 1,
+                     static_cast<double>(kSize - 1)));
+        break;
+      case kBanded:
+        i = static_cast<uint32_t>(std::clamp<int64_t>(
+            static_cast<int64_t>(j) + band(generator), 0, kSize - 1));
+        break;
+    }
+    result.i[ix] = i;
+    result.j[ix] = j;
+    result.x[ix] = static_cast<double>(ix);
+  }
+  return result;
+}
+
+auto layout_name(const int64_t layout) -> const char* {
+  switch (layout) {
+    case kUniform:
+      return "uniform";
+    case kPowerLaw:
+      return "power-law";
+    default:
+      return "banded";
+  }
+}
+
+// Inserts the entries one at a time.
+auto BM_Set(benchmark::State& state) -> void {
+  auto entries =
+      make_entries(static_cast<Layout>(state.range(0)), state.range(1));
+  auto n = entries.x.size();
+  auto bytes = size_t(0);
+  for (auto _ : state) {
+    auto matrix = Matrix<>();
+    for (size_t ix = 0; ix < n; ++ix) {
+      matrix.set({entries.i[ix], entries.j[ix]}, entries.x[ix]);
+    }
+    bytes = matrix.nbytes() / std::max(matrix.nnz(), size_t(1));
+  }
+  state.SetLabel(layout_name(state.range(0)));
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["bytes_per_nnz"] = static_cast<double>(bytes);
+}
+
+// Inserts the entries in bulk.
+auto BM_SetBulk(benchmark::State& state) -> void {
+  auto entries =
+      make_entries(static_cast<Layout>(state.range(0)), state.range(1));
+  auto n = entries.x.size();
+  auto bytes = size_t(0);
+  for (auto _ : state) {
+    auto matrix = Matrix<>();
+    matrix.set(entries.i.data(), entries.j.data(), entries.x.data(), n);
+    bytes = matrix.nbytes() / std::max(matrix.nnz(), size_t(1));
+  }
+  state.SetLabel(layout_name(state.range(0)));
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["bytes_per_nnz"] = static_cast<double>(bytes);
+}
+
+// Reads cells one at a time, half of them stored (hits), half of them not
+// (misses).
+auto BM_Get(benchmark::State& state) -> void {
+  auto entries =
+      make_entries(static_cast<Layout>(state.range(0)), state.range(1));
+  auto n = entries.x.size();
+  auto matrix = Matrix<>();
+  matrix.set(entries.i.data(), entries.j.data(), entries.x.data(), n);
+  if (state.range(2)) {
+    matrix.freeze();
+  }
+  auto generator = std::mt19937_64(1);
+  std::shuffle(entries.j.begin() + n / 2, entries.j.end(), generator);
+  for (auto _ : state) {
+    auto sum = 0.0;
+    for (size_t ix = 0; ix < n; ++ix) {
+      sum += matrix.get({entries.i[ix], entries.j[ix]});
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetLabel(std::string(layout_name(state.range(0))) +
+                 (state.range(2) ? "/frozen" : "/mutable"));
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Reads entries in bulk.
+auto BM_Take(benchmark::State& state) -> void {
+  auto entries =
+      make_entries(static_cast<Layout>(state.range(0)), state.range(1));
+  auto n = entries.x.size();
+  auto matrix = Matrix<>();
+  matrix.set(entries.i.data(), entries.j.data(), entries.x.data(), n);
+  if (state.range(2)) {
+    matrix.freeze();
+  }
+  auto values = std::vector<double>(n);
+  for (auto _ : state) {
+    matrix.take(entries.i.data(), entries.j.data(), n, 0.0, values.data());
+    benchmark::DoNotOptimize(values.data());
+  }
+  state.SetLabel(std::string(layout_name(state.range(0))) +
+                 (state.range(2) ? "/frozen" : "/mutable"));
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+auto write_arguments(benchmark::internal::Benchmark* benchmark) -> void {
+  for (auto layout : {kUniform, kPowerLaw, kBanded}) {
+    for (auto n : {1 << 16, 1 << 20}) {
+      benchmark->Args({layout, n});
+    }
+  }
+}
+
+auto read_arguments(benchmark::internal::Benchmark* benchmark) -> void {
+  for (auto layout : {kUniform, kPowerLaw, kBanded}) {
+    for (auto frozen : {0, 1}) {
+      benchmark->Args({layout, 1 << 20, frozen});
+    }
+  }
+}
+
+BENCHMARK(BM_Set)->Apply(write_arguments)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SetBulk)->Apply(write_arguments)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Get)->Apply(read_arguments)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Take)->Apply(read_arguments)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
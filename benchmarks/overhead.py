@@ -0,0 +1,57 @@
+"""Per-call overhead of the element and slice accessors of ``core.Matrix``.
+
+Usage: python benchmarks/overhead.py [--path BUILD_DIR]
+
+BUILD_DIR is the directory containing the compiled ``core`` module.
+"""
+import argparse
+import sys
+import timeit
+
+import numpy as np
+
+
+def import_core(path):
+    if path is not None:
+        sys.path.insert(0, path)
+    try:
+        from sparse import core
+    except ImportError:
+        import core
+    return core
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--path", help="directory of the core module")
+    parser.add_argument("--size", type=int, default=4096)
+    parser.add_argument("--nnz", type=int, default=1_000_000)
+    parser.add_argument("--number", type=int, default=10_000)
+    args = parser.parse_args()
+
+    core = import_core(args.path)
+    rng = np.random.default_rng(0)
+    m = core.Matrix()
+    m.set(rng.integers(0, args.size, args.nnz, dtype=np.uint32),
+          rng.integers(0, args.size, args.nnz, dtype=np.uint32),
+          rng.random(args.nnz))
+
+    cases = {
+        "m[i, j]": lambda: m[17, 42],
+        "m[i, 0:1]": lambda: m[17, 0:1],
+        "m[0:1, 0:1]": lambda: m[0:1, 0:1],
+        "m.get((i, j))": lambda: m.get((17, 42)),
+        "m.get((0:1, 0:1))": lambda: m.get((slice(0, 1), slice(0, 1))),
+    }
+    for name, stmt in cases.items():
+        elapsed = timeit.timeit(stmt, number=args.number)
+        print(f"{name:20s} {elapsed / args.number * 1e9:10.1f} ns/call")
+
+    window = (slice(0, args.size), slice(0, args.size))
+    elapsed = timeit.timeit(lambda: m[window], number=3) / 3
+    cells = args.size * args.size
+    print(f"{'m[window]':20s} {elapsed / cells * 1e9:10.1f} ns/cell")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,80 @@
+"""Time of ``m[rows, cols]`` for square windows of ``core.Matrix``.
+
+Usage: python benchmarks/window.py [--path BUILD_DIR]
+
+BUILD_DIR is the directory containing the compiled ``core`` module.
+
+A mutable matrix is read by probing each cell of the window while the window
+holds fewer than 4 cells per stored entry, and by walking the stored entries
+otherwise (``kProbeCost`` in sparse.hpp). Timings of the two strategies on one
+core, random entries in a 65536 x 65536 matrix:
+
+    nnz      window   cells/nnz   probe (ms)   scan (ms)
+    2^20       256      0.06          3.9        22.4
+    2^20      1024      1.0          68.9        26.3
+    2^20      2048      4.0         275.2        26.9
+    2^23      1024      0.13         88.5       173.2
+    2^23      2048      0.5         362.9       183.4
+    2^23      4096      2.0        1407.8       197.1
+
+A probe costs 3 to 4 times the visit of a stored entry. The last columns time
+the same windows on the matrix frozen in CSR layout and in tiled layout
+(``freeze("tiled")``), which only visits the 64 x 64 tiles overlapping the
+window.
+"""
+import argparse
+import sys
+import timeit
+
+import numpy as np
+
+
+def import_core(path):
+    if path is not None:
+        sys.path.insert(0, path)
+    try:
+        from sparse import core
+    except ImportError:
+        import core
+    return core
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--path", help="directory of the core module")
+    parser.add_argument("--size", type=int, default=65536)
+    parser.add_argument("--nnz", type=int, nargs="+",
+                        default=[1 << 20, 1 << 23])
+    parser.add_argument("--window", type=int, nargs="+",
+                        default=[64, 256, 1024, 2048, 4096])
+    parser.add_argument("--number", type=int, default=3)
+    args = parser.parse_args()
+
+    core = import_core(args.path)
+    rng = np.random.default_rng(0)
+    print(f"{'nnz':>10s} {'window':>8s} {'cells/nnz':>10s} "
+          f"{'mutable (ms)':>13s} {'frozen (ms)':>12s} {'tiled (ms)':>11s}")
+    for nnz in args.nnz:
+        i = rng.integers(0, args.size, nnz, dtype=np.uint32)
+        j = rng.integers(0, args.size, nnz, dtype=np.uint32)
+        x = rng.random(nnz)
+        m = core.Matrix()
+        m.set(i, j, x)
+        frozen = core.Matrix()
+        frozen.set(i, j, x)
+        frozen.freeze()
+        tiled = core.Matrix()
+        tiled.set(i, j, x)
+        tiled.freeze("tiled")
+        for size in args.window:
+            window = (slice(0, size), slice(0, size))
+            times = [
+                timeit.timeit(lambda: matrix[window], number=args.number) /
+                args.number * 1e3 for matrix in (m, frozen, tiled)
+            ]
+            print(f"{nnz:10d} {size:8d} {size * size / nnz:10.3f} "
+                  f"{times[0]:13.2f} {times[1]:12.2f} {times[2]:11.2f}")
+
+
+if __name__ == "__main__":
+    main()
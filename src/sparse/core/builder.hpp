@@ -0,0 +1,140 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "sparse.hpp"
+
+// Builds a matrix from chunks of entries, inserted by a background thread
+// while the caller prepares the next chunk. The chunks are double-buffered:
+// one chunk is inserted while the next one waits in the queue, "append"
+// blocking until the queue is free.
+template <typename T, typename I = uint32_t>
+class Builder {
+ public:
+  using Matrix = ::Matrix<T, I>;
+
+  // Entries (i[k], j[k], x[k]) of a chunk.
+  struct Chunk {
+    std::vector<I> i;
+    std::vector<I> j;
+    std::vector<Storage<T>> x;
+  };
+
+  // The hash table of the matrix is sized for "expected_nnz" entries. The
+  // values of an entry given several times are summed if "accumulate" is
+  // true; otherwise the last one is kept.
+  Builder(const size_t expected_nnz, const bool accumulate)
+      : accumulate_(accumulate) {
+    matrix_.reserve(expected_nnz);
+  }
+
+  Builder(const Builder&) = delete;
+  auto operator=(const Builder&) -> Builder& = delete;
+
+  ~Builder() { stop(); }
+
+  // Queues a chunk of entries, waiting for the queue to be free. The error
+  // raised by the insertion of a previous chunk is rethrown.
+  auto append(Chunk chunk) -> void {
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    if (finalized_) {
+      throw std::runtime_error("the matrix has already been built");
+    }
+    if (!worker_.joinable()) {
+      worker_ = std::thread([this]() { run(); });
+    }
+    ready_.wait(lock, [&]() { return queue_.empty() || exception_; });
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+    queue_.push_back(std::move(chunk));
+    ready_.notify_all();
+  }
+
+  // Waits for the insertion of the queued chunks and returns the matrix.
+  // The builder holds no entry afterwards and accepts no more chunks.
+  auto finalize() -> Matrix {
+    stop();
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    if (finalized_) {
+      throw std::runtime_error("the matrix has already been built");
+    }
+    finalized_ = true;
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+    auto result = matrix_;
+    matrix_ = Matrix();
+    return result;
+  }
+
+ private:
+  // Inserts the queued chunks until the builder is stopped and the queue is
+  // empty. After an error, the chunks are dropped.
+  auto run() -> void {
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    while (true) {
+      ready_.wait(lock, [&]() { return !queue_.empty() || stopped_; });
+      if (queue_.empty()) {
+        return;
+      }
+      auto chunk = std::move(queue_.front());
+      queue_.pop_front();
+      ready_.notify_all();
+      if (exception_) {
+        continue;
+      }
+      lock.unlock();
+      auto exception = std::exception_ptr();
+      try {
+        insert(chunk);
+      } catch (...) {
+        exception = std::current_exception();
+      }
+      chunk = Chunk();
+      lock.lock();
+      if (exception) {
+        exception_ = exception;
+        ready_.notify_all();
+      }
+    }
+  }
+
+  auto insert(const Chunk& chunk) -> void {
+    auto x = reinterpret_cast<const T*>(chunk.x.data());
+    if (accumulate_) {
+      matrix_.add(chunk.i.data(), chunk.j.data(), x, chunk.x.size());
+    } else {
+      matrix_.set(chunk.i.data(), chunk.j.data(), x, chunk.x.size());
+    }
+  }
+
+  // Waits for the background thread to insert the queued chunks.
+  auto stop() -> void {
+    {
+      auto lock = std::unique_lock<std::mutex>(mutex_);
+      if (!worker_.joinable()) {
+        return;
+      }
+      stopped_ = true;
+      ready_.notify_all();
+    }
+    worker_.join();
+  }
+
+  Matrix matrix_;
+  bool accumulate_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<Chunk> queue_;
+  std::exception_ptr exception_;
+  bool stopped_{false};
+  bool finalized_{false};
+  std::thread worker_;
+};
@@ -0,0 +1,255 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "radix_sort.hpp"
+#include "types.hpp"
+
+// Read-only array whose items are owned by another object: a vector, a
+// memory mapped file, ...
+template <typename T>
+class Array {
+ public:
+  Array() = default;
+
+  explicit Array(std::vector<T>&& items) {
+    auto owner = std::make_shared<std::vector<T>>(std::move(items));
+    data_ = owner->data();
+    size_ = owner->size();
+    owner_ = std::move(owner);
+  }
+
+  Array(const T* data, const size_t size, std::shared_ptr<const void> owner)
+      : data_(data), size_(size), owner_(std::move(owner)) {}
+
+  auto operator[](const size_t ix) const -> const T& { return data_[ix]; }
+  auto data() const -> const T* { return data_; }
+  auto size() const -> size_t { return size_; }
+  auto begin() const -> const T* { return data_; }
+  auto end() const -> const T* { return data_ + size_; }
+
+ private:
+  const T* data_{nullptr};
+  size_t size_{0};
+  std::shared_ptr<const void> owner_;
+};
+
+// Compressed sparse storage (CSR or CSC): the entries are grouped by major
+// index; within a group, the minor indices are sorted in ascending order.
+// The storage of a boolean matrix holds no data: all its entries are true.
+//
+// When most of the major indices hold no entry (e.g. rows indexed by a
+// 64-bit hash), the storage is hypersparse: "majors" lists the non-empty
+// major indices in ascending order and "indptr" only bounds their segments,
+// so that the size of the storage does not depend on the shape of the
+// matrix.
+template <typename T, typename I = uint32_t>
+struct Compressed {
+  using Key = typename Packing<I>::Key;
+
+  static constexpr bool kPattern = std::is_same<T, bool>::value;
+
+  // Axis of the storage used as the major axis (0: rows, 1: columns).
+  int axis{0};
+  Array<uint64_t> indptr{std::vector<uint64_t>{0}};
+  Array<I> majors;
+  Array<I> indices;
+  Array<T> data;
+
+  // Builds the compressed storage of "size" entries, "visit(f)" calling
+  // "f(key, value)" for each entry, keys packed by "Packing<I>". "major" is
+  // the number of indices along the major axis. The storage is hypersparse
+  // if there are more major indices than entries. The entries are sorted by
+  // a radix sort on their keys packed in (major, minor) order.
+  template <typename Visitor>
+  static auto build(const size_t size, const int axis, const size_t major,
+                    const Visitor& visit) -> Compressed {
+    struct Item {
+      Key key;
+      Storage<T> value;
+    };
+    auto items = std::vector<Item>();
+    auto minor = I(0);
+    items.reserve(size);
+    visit([&](const Key& key, const T value) {
+      auto index = Compressed::split(key, axis);
+      minor = std::max(minor, index.second);
+      items.push_back({Packing<I>::pack(index.first, index.second), value});
+    });
+    // 64-bit keys are packed on the bits of the indices, for the radix sort
+    // to skip the bits that are always zero: (major << width) | minor.
+    auto width = size_t(0);
+    if constexpr (sizeof(I) <= 4) {
+      while (width < 32 && (uint64_t(minor) >> width) != 0) {
+        ++width;
+      }
+      for (auto& item : items) {
+        auto index = Packing<I>::split(item.key);
+        item.key = (uint64_t(index.first) << width) | index.second;
+      }
+    }
+    auto split = [&](const Key& key) -> std::pair<I, I> {
+      if constexpr (sizeof(I) <= 4) {
+        return {static_cast<I>(key >> width),
+                static_cast<I>(key & ((uint64_t(1) << width) - 1))};
+      } else {
+        return Packing<I>::split(key);
+      }
+    };
+    radix_sort(items);
+
+    auto majors = std::vector<I>();
+    auto indptr = std::vector<uint64_t>{0};
+    if (major > size) {
+      for (auto& item : items) {
+        auto index = split(item.key).first;
+        if (majors.empty() || majors.back() != index) {
+          majors.push_back(index);
+          indptr.push_back(indptr.back());
+        }
+        ++indptr.back();
+      }
+    } else {
+      indptr.resize(major + 1, 0);
+      for (auto& item : items) {
+        ++indptr[split(item.key).first + 1];
+      }
+      for (size_t ix = 0; ix < major; ++ix) {
+        indptr[ix + 1] += indptr[ix];
+      }
+    }
+
+    auto indices = std::vector<I>(size);
+    auto data = std::vector<T>(kPattern ? 0 : size);
+    parallel_for(size, num_threads(size, size_t(1) << 16),
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     indices[ix] = split(items[ix].key).second;
+                     if constexpr (!kPattern) {
+                       data[ix] = items[ix].value;
+                     }
+                   }
+                 });
+
+    auto result = Compressed();
+    result.axis = axis;
+    result.indptr = Array<uint64_t>(std::move(indptr));
+    if (!majors.empty()) {
+      result.majors = Array<I>(std::move(majors));
+    }
+    result.indices = Array<I>(std::move(indices));
+    if constexpr (!kPattern) {
+      result.data = Array<T>(std::move(data));
+    }
+    return result;
+  }
+
+  // Splits a packed key into its (major, minor) indices.
+  static auto split(const Key& key, const int axis) -> std::pair<I, I> {
+    auto index = Packing<I>::split(key);
+    return axis == 0 ? index : std::make_pair(index.second, index.first);
+  }
+
+  // Packs (major, minor) indices into a key.
+  auto pack(const I major, const I minor) const -> Key {
+    return axis == 0 ? Packing<I>::pack(major, minor)
+                     : Packing<I>::pack(minor, major);
+  }
+
+  auto size() const -> size_t { return indices.size(); }
+
+  auto hypersparse() const -> bool { return majors.size() != 0; }
+
+  // Number of segments: the number of indices along the major axis, or the
+  // number of non-empty major indices if the storage is hypersparse.
+  auto major() const -> size_t { return indptr.size() - 1; }
+
+  // Major index of the segment "ix".
+  auto index(const size_t ix) const -> I {
+    return hypersparse() ? majors[ix] : static_cast<I>(ix);
+  }
+
+  // Value of the entry stored at the position "ix".
+  auto value(const size_t ix) const -> T {
+    if constexpr (kPattern) {
+      return true;
+    } else {
+      return data[ix];
+    }
+  }
+
+  // Range [first, last) of the entries stored along a major index.
+  auto segment(const size_t major) const -> std::pair<uint64_t, uint64_t> {
+    auto ix = major;
+    if (hypersparse()) {
+      auto it = std::lower_bound(majors.begin(), majors.end(), major);
+      if (it == majors.end() || *it != major) {
+        return {0, 0};
+      }
+      ix = static_cast<size_t>(it - majors.begin());
+    }
+    if (ix >= this->major()) {
+      return {0, 0};
+    }
+    return {indptr[ix], indptr[ix + 1]};
+  }
+
+  // Range [first, last) of the entries stored along a major index whose
+  // minor index lies in [lower, upper).
+  auto segment(const size_t major, const size_t lower,
+               const size_t upper) const -> std::pair<uint64_t, uint64_t> {
+    auto range = segment(major);
+    auto first = indices.begin() + range.first;
+    auto last = indices.begin() + range.second;
+    if (range.first == range.second || upper <= lower) {
+      return {range.first, range.first};
+    }
+    if (lower > *first) {
+      first = std::lower_bound(first, last, lower);
+    }
+    if (upper <= *(last - 1)) {
+      last = std::lower_bound(first, last, upper);
+    }
+    return {static_cast<uint64_t>(first - indices.begin()),
+            static_cast<uint64_t>(last - indices.begin())};
+  }
+
+  // Same storage, not hypersparse, "major" being the number of indices
+  // along the major axis. The indices and data are shared.
+  auto expand(const size_t major) const -> Compressed {
+    auto offsets = std::vector<uint64_t>(major + 1, 0);
+    for (size_t ix = 0; ix < this->major(); ++ix) {
+      offsets[static_cast<size_t>(index(ix)) + 1] =
+          indptr[ix + 1] - indptr[ix];
+    }
+    for (size_t ix = 0; ix < major; ++ix) {
+      offsets[ix + 1] += offsets[ix];
+    }
+    auto result = *this;
+    result.indptr = Array<uint64_t>(std::move(offsets));
+    result.majors = Array<I>();
+    return result;
+  }
+
+  // Position of the entry (major, minor), or -1 if it is not stored.
+  auto search(const size_t major, const size_t minor) const -> int64_t {
+    auto range = segment(major);
+    auto first = indices.begin() + range.first;
+    auto last = indices.begin() + range.second;
+    auto it = std::lower_bound(first, last, minor);
+    if (it == last || *it != minor) {
+      return -1;
+    }
+    return it - indices.begin();
+  }
+
+  auto memory_usage() const -> size_t {
+    return indptr.size() * sizeof(uint64_t) +
+           (majors.size() + indices.size()) * sizeof(I) +
+           data.size() * sizeof(T);
+  }
+};
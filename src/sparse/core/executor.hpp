@@ -0,0 +1,78 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Pool of threads running tasks in submission order. The threads are started
+// on demand, up to "threads", when no started thread is idle. The tasks may
+// block (e.g. waiting for a lock), unlike the kernels run by "parallel_for",
+// but must not throw.
+class Executor {
+ public:
+  explicit Executor(const size_t threads) : threads_(threads) {}
+
+  Executor(const Executor&) = delete;
+  auto operator=(const Executor&) -> Executor& = delete;
+
+  ~Executor() { stop(); }
+
+  auto submit(std::function<void()> task) -> void {
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    if (stopped_) {
+      throw std::runtime_error("the executor is stopped");
+    }
+    tasks_.push_back(std::move(task));
+    if (idle_ == 0 && workers_.size() < threads_) {
+      workers_.emplace_back([this]() { run(); });
+    } else {
+      ready_.notify_one();
+    }
+  }
+
+  // Waits for the tasks submitted to complete, and stops the threads. The
+  // tasks submitted afterwards are rejected.
+  auto stop() -> void {
+    auto workers = std::vector<std::thread>();
+    {
+      auto lock = std::unique_lock<std::mutex>(mutex_);
+      stopped_ = true;
+      ready_.notify_all();
+      workers.swap(workers_);
+    }
+    for (auto& item : workers) {
+      item.join();
+    }
+  }
+
+ private:
+  auto run() -> void {
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    while (true) {
+      ++idle_;
+      ready_.wait(lock, [&]() { return !tasks_.empty() || stopped_; });
+      --idle_;
+      if (tasks_.empty()) {
+        return;
+      }
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  size_t threads_;
+  size_t idle_{0};
+  bool stopped_{false};
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> tasks_;
+  std::vector<std::thread> workers_;
+};
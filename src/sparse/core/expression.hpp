@@ -0,0 +1,436 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "compressed.hpp"
+#include "parallel.hpp"
+#include "sparse.hpp"
+#include "types.hpp"
+
+// Lazy expression of matrices: a tree of elementwise sums and products whose
+// leaves are matrices, evaluated by "evaluate" or by a reduction in a single
+// pass. The rows (or the columns) of the leaves, compressed and sorted, are
+// merged entry by entry and the tree is evaluated for each index stored by
+// a leaf, so that no intermediate matrix is built. The results are the ones
+// of "Matrix::plus" and "Matrix::multiply" applied in the order of the tree.
+//
+// The leaves are copies of the matrices (see the copy constructor of
+// "Matrix"): the expression is not changed by the later writes to its
+// operands. Like "Matrix::transposed", "transposed" is a view which costs
+// O(1).
+template <typename T = double, typename I = uint32_t>
+class Expression {
+ public:
+  using Matrix = ::Matrix<T, I>;
+  using Key = typename Matrix::Key;
+  using Sum = typename Matrix::Sum;
+  using Compressed = ::Compressed<T, I>;
+
+  static constexpr bool kPattern = Matrix::kPattern;
+
+  explicit Expression(const Matrix& matrix)
+      : root_(std::make_shared<Node>(
+            Node{Operation::kLeaf, matrix, {}, {}})) {}
+
+  // Elementwise sum (see "Matrix::plus").
+  auto plus(const Expression& rhs) const -> Expression {
+    return combine(Operation::kPlus, rhs);
+  }
+
+  // Elementwise product (see "Matrix::multiply").
+  auto multiply(const Expression& rhs) const -> Expression {
+    return combine(Operation::kMultiply, rhs);
+  }
+
+  auto transposed() const -> Expression {
+    auto result = *this;
+    result.ji_ = !ji_;
+    return result;
+  }
+
+  // Shape of the result: the bounds of the shapes of the leaves.
+  auto shape() const -> Key {
+    auto result = Expression::bounds(*root_);
+    if (ji_) {
+      return std::make_tuple(std::get<1>(result), std::get<0>(result));
+    }
+    return result;
+  }
+
+  // Matrix holding the result, frozen in CSR layout (in CSC layout if the
+  // expression is transposed).
+  auto evaluate() const -> Matrix {
+    auto program = compile(false);
+    auto majors = active(program);
+    auto threads = num_threads(program.size, kMergeGrain);
+    auto rows = std::vector<typename Matrix::Rows>(threads);
+    parallel_for(
+        majors.size(), threads,
+        [&](const size_t rank, const size_t first, const size_t last) {
+          auto& out = rows[rank];
+          auto state = State(program);
+          for (auto ix = first; ix < last; ++ix) {
+            auto count = out.indices.size();
+            merge(program, majors[ix], state, [&](const I j, const T x) {
+              out.indices.push_back(j);
+              if constexpr (!kPattern) {
+                out.data.push_back(x);
+              }
+            });
+            if (out.indices.size() != count) {
+              out.majors.push_back(majors[ix]);
+              out.counts.push_back(out.indices.size() - count);
+            }
+          }
+        });
+    return Matrix::from_rows(rows, Expression::bounds(*root_), ji_);
+  }
+
+  // Same as "Matrix::sum", "Matrix::count_nonzero", "Matrix::mean",
+  // "Matrix::max" and "Matrix::min", applied to the result.
+  auto sum(const int axis) const -> std::vector<Sum> {
+    return reduce<Sum>(
+               axis, Sum(0), [](const T x) { return static_cast<Sum>(x); },
+               [](const Sum lhs, const Sum rhs) { return lhs + rhs; })
+        .values;
+  }
+
+  auto count_nonzero(const int axis) const -> std::vector<int64_t> {
+    return reduce<int64_t>(
+               axis, int64_t(0),
+               [](const T x) { return static_cast<int64_t>(x != T(0)); },
+               [](const int64_t lhs, const int64_t rhs) { return lhs + rhs; })
+        .values;
+  }
+
+  auto mean(const int axis) const -> std::vector<double> {
+    auto reduction = reduce<Sum>(
+        axis, Sum(0), [](const T x) { return static_cast<Sum>(x); },
+        [](const Sum lhs, const Sum rhs) { return lhs + rhs; });
+    auto result = std::vector<double>(reduction.values.size());
+    for (size_t ix = 0; ix < result.size(); ++ix) {
+      result[ix] = static_cast<double>(reduction.values[ix]) /
+                   static_cast<double>(reduction.length);
+    }
+    return result;
+  }
+
+  auto max(const int axis) const -> std::vector<Storage<T>> {
+    return extremum(axis, std::numeric_limits<T>::lowest(),
+                    [](const Storage<T> lhs, const Storage<T> rhs) {
+                      return std::max(lhs, rhs);
+                    });
+  }
+
+  auto min(const int axis) const -> std::vector<Storage<T>> {
+    return extremum(axis, std::numeric_limits<T>::max(),
+                    [](const Storage<T> lhs, const Storage<T> rhs) {
+                      return std::min(lhs, rhs);
+                    });
+  }
+
+ private:
+  enum class Operation { kLeaf, kPlus, kMultiply };
+
+  // Node of the tree: a matrix if it is a leaf, the operation applied to
+  // its operands otherwise.
+  struct Node {
+    Operation op;
+    Matrix matrix;
+    std::shared_ptr<const Node> lhs;
+    std::shared_ptr<const Node> rhs;
+  };
+
+  // Step of the evaluation of the tree, in post-order: the step "sx" reads
+  // the leaf "lhs", or combines the results of the steps "lhs" and "rhs".
+  struct Step {
+    Operation op;
+    size_t lhs;
+    size_t rhs;
+  };
+
+  // Tree flattened into its steps, the last one computing the result, and
+  // the storages of the leaves compressed along the same axis.
+  struct Program {
+    std::vector<Step> steps;
+    std::vector<std::shared_ptr<const Compressed>> leaves;
+    size_t size{0};
+  };
+
+  // Entries of a segment of a leaf not merged yet.
+  struct Cursor {
+    const I* first;
+    const I* last;
+    const T* data;
+  };
+
+  // Position of the merge in the segment of each leaf, and result of each
+  // step for the current index.
+  struct State {
+    explicit State(const Program& program)
+        : cursors(program.leaves.size()),
+          values(program.steps.size()),
+          stored(program.steps.size()) {}
+
+    std::vector<Cursor> cursors;
+    std::vector<Storage<T>> values;
+    std::vector<uint8_t> stored;
+  };
+
+  template <typename R>
+  struct Reduction {
+    std::vector<R> values;
+    std::vector<uint64_t> counts;
+    size_t length;
+  };
+
+  // Minimum number of entries merged by a thread.
+  static constexpr size_t kMergeGrain = 1 << 15;
+
+  Expression(std::shared_ptr<const Node> root, const bool ji)
+      : root_(std::move(root)), ji_(ji) {}
+
+  // Combines the expression with "rhs", whose leaves are transposed if it is
+  // not viewed in the same orientation.
+  auto combine(const Operation op, const Expression& rhs) const
+      -> Expression {
+    auto other =
+        rhs.ji_ == ji_ ? rhs.root_ : Expression::transpose(rhs.root_);
+    return Expression(
+        std::make_shared<Node>(Node{op, Matrix(), root_, std::move(other)}),
+        ji_);
+  }
+
+  static auto transpose(const std::shared_ptr<const Node>& node)
+      -> std::shared_ptr<const Node> {
+    if (node->op == Operation::kLeaf) {
+      return std::make_shared<Node>(
+          Node{Operation::kLeaf, node->matrix.transposed(), {}, {}});
+    }
+    return std::make_shared<Node>(Node{node->op, Matrix(),
+                                       Expression::transpose(node->lhs),
+                                       Expression::transpose(node->rhs)});
+  }
+
+  // Shape of the tree rooted at "node", not transposed.
+  static auto bounds(const Node& node) -> Key {
+    if (node.op == Operation::kLeaf) {
+      return node.matrix.shape();
+    }
+    auto lhs = Expression::bounds(*node.lhs);
+    auto rhs = Expression::bounds(*node.rhs);
+    return {std::max(std::get<0>(lhs), std::get<0>(rhs)),
+            std::max(std::get<1>(lhs), std::get<1>(rhs))};
+  }
+
+  // Flattens the tree, the leaves being compressed along the rows of the
+  // tree (its columns if "csc").
+  auto compile(const bool csc) const -> Program {
+    auto program = Program();
+    Expression::visit(*root_, csc, program);
+    return program;
+  }
+
+  static auto visit(const Node& node, const bool csc, Program& program)
+      -> size_t {
+    auto step = Step{node.op, 0, 0};
+    if (node.op == Operation::kLeaf) {
+      step.lhs = program.leaves.size();
+      program.leaves.push_back(node.matrix.sorted(csc));
+      program.size += program.leaves.back()->size();
+    } else {
+      step.lhs = Expression::visit(*node.lhs, csc, program);
+      step.rhs = Expression::visit(*node.rhs, csc, program);
+    }
+    program.steps.push_back(step);
+    return program.steps.size() - 1;
+  }
+
+  // Major indices holding entries in some leaf, in ascending order.
+  static auto active(const Program& program) -> std::vector<I> {
+    auto result = std::vector<I>();
+    for (auto& leaf : program.leaves) {
+      auto& indptr = leaf->indptr;
+      auto begin = result.size();
+      for (size_t ix = 0; ix < leaf->major(); ++ix) {
+        if (indptr[ix] != indptr[ix + 1]) {
+          result.push_back(leaf->index(ix));
+        }
+      }
+      std::inplace_merge(result.begin(), result.begin() + begin, result.end());
+    }
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  }
+
+  // Calls "f(minor, x)" for each entry of the result along the major index
+  // "major", in ascending order of the minor indices.
+  template <typename F>
+  static auto merge(const Program& program, const I major, State& state,
+                    const F& f) -> void {
+    auto& cursors = state.cursors;
+    for (size_t lx = 0; lx < cursors.size(); ++lx) {
+      auto& leaf = *program.leaves[lx];
+      auto range = leaf.segment(major);
+      cursors[lx].first = leaf.indices.data() + range.first;
+      cursors[lx].last = leaf.indices.data() + range.second;
+      if constexpr (!kPattern) {
+        cursors[lx].data = leaf.data.data() + range.first;
+      }
+    }
+    auto& values = state.values;
+    auto& stored = state.stored;
+    while (true) {
+      // Smallest minor index not merged yet.
+      auto minor = std::numeric_limits<I>::max();
+      auto done = true;
+      for (auto& cursor : cursors) {
+        if (cursor.first != cursor.last) {
+          minor = std::min(minor, *cursor.first);
+          done = false;
+        }
+      }
+      if (done) {
+        return;
+      }
+      for (size_t sx = 0; sx < program.steps.size(); ++sx) {
+        auto& step = program.steps[sx];
+        if (step.op == Operation::kLeaf) {
+          auto& cursor = cursors[step.lhs];
+          stored[sx] = cursor.first != cursor.last && *cursor.first == minor;
+          values[sx] = Storage<T>(0);
+          if (stored[sx]) {
+            ++cursor.first;
+            if constexpr (kPattern) {
+              values[sx] = true;
+            } else {
+              values[sx] = *cursor.data++;
+            }
+          }
+        } else if (step.op == Operation::kPlus) {
+          stored[sx] = stored[step.lhs] || stored[step.rhs];
+          values[sx] = Expression::add(values[step.lhs], values[step.rhs]);
+        } else {
+          // The product is only computed if both entries are stored, the
+          // value 0 of a missing entry giving NaN with an infinite value.
+          auto both = stored[step.lhs] && stored[step.rhs];
+          values[sx] =
+              both ? Expression::product(values[step.lhs], values[step.rhs])
+                   : Storage<T>(0);
+          stored[sx] = both && values[sx] != Storage<T>(0);
+        }
+      }
+      if (stored.back()) {
+        f(minor, values.back());
+      }
+    }
+  }
+
+  static auto add(const Storage<T> lhs, const Storage<T> rhs) -> Storage<T> {
+    if constexpr (kPattern) {
+      return lhs || rhs;
+    } else {
+      return static_cast<T>(lhs + rhs);
+    }
+  }
+
+  static auto product(const Storage<T> lhs, const Storage<T> rhs)
+      -> Storage<T> {
+    if constexpr (kPattern) {
+      return lhs && rhs;
+    } else {
+      return static_cast<T>(lhs * rhs);
+    }
+  }
+
+  // Reduces the entries of the result along "axis" (see "Matrix::reduce"),
+  // each result of a row (or of a column) being folded while its entries
+  // are merged.
+  template <typename R, typename F, typename Op>
+  auto reduce(const int axis, const R init, const F& map, const Op& op) const
+      -> Reduction<R> {
+    auto shape = Expression::bounds(*root_);
+    auto rows = size_t(std::get<0>(shape));
+    auto cols = size_t(std::get<1>(shape));
+    // Axis of the tree indexing the results, -1 if there is a single one.
+    auto kept = axis == -1 ? -1 : ((axis == 0) != ji_ ? 1 : 0);
+    auto size = kept == -1 ? size_t(1) : (kept == 0 ? rows : cols);
+    auto program = compile(kept == 1);
+    auto majors = active(program);
+    auto threads = num_threads(program.size, kMergeGrain);
+    auto result = Reduction<R>{
+        std::vector<R>(size, init), std::vector<uint64_t>(size, 0),
+        kept == -1 ? rows * cols : (kept == 0 ? cols : rows)};
+    // Results of a single line computed by each thread.
+    auto partials = Reduction<R>{std::vector<R>(threads, init),
+                                 std::vector<uint64_t>(threads, 0), 0};
+    parallel_for(
+        majors.size(), threads,
+        [&](const size_t rank, const size_t first, const size_t last) {
+          auto state = State(program);
+          for (auto ix = first; ix < last; ++ix) {
+            auto value = init;
+            auto count = uint64_t(0);
+            merge(program, majors[ix], state, [&](const I, const T x) {
+              value = op(value, map(x));
+              ++count;
+            });
+            if (kept == -1) {
+              partials.values[rank] = op(partials.values[rank], value);
+              partials.counts[rank] += count;
+            } else {
+              result.values[majors[ix]] = value;
+              result.counts[majors[ix]] = count;
+            }
+          }
+        });
+    if (kept == -1) {
+      for (size_t ix = 0; ix < threads; ++ix) {
+        result.values[0] = op(result.values[0], partials.values[ix]);
+        result.counts[0] += partials.counts[ix];
+      }
+    }
+
+    // The result of an empty matrix has no shape (see "Matrix::shape").
+    auto nnz = size_t(0);
+    for (auto count : result.counts) {
+      nnz += count;
+    }
+    if (nnz == 0) {
+      result.length = 0;
+      if (kept != -1) {
+        result.values.clear();
+        result.counts.clear();
+      }
+    }
+    return result;
+  }
+
+  template <typename Op>
+  auto extremum(const int axis, const T init, const Op& op) const
+      -> std::vector<Storage<T>> {
+    auto reduction = reduce<Storage<T>>(
+        axis, static_cast<Storage<T>>(init),
+        [](const T x) { return static_cast<Storage<T>>(x); }, op);
+    if (reduction.length == 0) {
+      throw std::invalid_argument(
+          "zero-size array to reduction operation which has no identity");
+    }
+    for (size_t ix = 0; ix < reduction.values.size(); ++ix) {
+      if (reduction.counts[ix] < reduction.length) {
+        reduction.values[ix] = op(reduction.values[ix], Storage<T>(0));
+      }
+    }
+    return std::move(reduction.values);
+  }
+
+  std::shared_ptr<const Node> root_;
+  // Whether the expression is a transposed view of its tree.
+  bool ji_{false};
+};
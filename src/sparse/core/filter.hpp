@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "types.hpp"
+
+// Occupancy filter of the keys stored by a matrix: a blocked Bloom filter of
+// the keys, each key setting a few bits of a single cache line, and a bitmap
+// of the rows holding entries. A key or a row absent from the filter is not
+// stored, so that most lookups missing the matrix read one cache line. The
+// removals do not clear the bits: the filter is rebuilt when it is full,
+// i.e. when it holds more keys than it was sized for. The bits can be set
+// concurrently.
+class Filter {
+ public:
+  // Bits of a block, and bits of the hash selecting a bit of a block.
+  static constexpr size_t kBlockBits = 512;
+  static constexpr size_t kBitShift = 9;
+
+  // Filter sized for "capacity" keys, using about "bits" bits per key for
+  // the keys and half as many for the rows.
+  Filter(const size_t capacity, const double bits) {
+    auto blocks = size_t(1);
+    while (blocks * kBlockBits < static_cast<double>(capacity) * bits) {
+      blocks *= 2;
+    }
+    blocks_ = std::vector<Block>(blocks);
+    rows_ = std::vector<Block>(std::max(blocks / 2, size_t(1)));
+    capacity_ = static_cast<size_t>(blocks * kBlockBits / bits);
+    hashes_ = std::clamp(static_cast<size_t>(std::lround(bits * std::log(2))),
+                         size_t(1), size_t(16));
+  }
+
+  Filter(const Filter&) = delete;
+  auto operator=(const Filter&) -> Filter& = delete;
+
+  // Adds the key of hash "hash" (see "hash_key") stored in the row "row".
+  auto insert(const uint64_t hash, const uint64_t row) -> void {
+    auto& block = block_of(hash);
+    auto first = hash & (kBlockBits - 1);
+    auto step = ((hash >> kBitShift) & (kBlockBits - 1)) | 1;
+    for (size_t ix = 0; ix < hashes_; ++ix) {
+      set(block, (first + ix * step) & (kBlockBits - 1));
+    }
+    auto bit = row_bit(row);
+    set(rows_[bit / kBlockBits], bit % kBlockBits);
+  }
+
+  // Records the insertion of "n" keys, counted against the capacity.
+  auto count(const size_t n) -> void {
+    count_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  // Returns false if the key of hash "hash" is not stored.
+  auto contains(const uint64_t hash) const -> bool {
+    auto& block = block_of(hash);
+    auto first = hash & (kBlockBits - 1);
+    auto step = ((hash >> kBitShift) & (kBlockBits - 1)) | 1;
+    for (size_t ix = 0; ix < hashes_; ++ix) {
+      if (!test(block, (first + ix * step) & (kBlockBits - 1))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns false if the row "row" holds no entries.
+  auto has_row(const uint64_t row) const -> bool {
+    auto bit = row_bit(row);
+    return test(rows_[bit / kBlockBits], bit % kBlockBits);
+  }
+
+  auto full() const -> bool {
+    return count_.load(std::memory_order_relaxed) > capacity_;
+  }
+
+  auto memory_usage() const -> size_t {
+    return sizeof(*this) + (blocks_.size() + rows_.size()) * sizeof(Block);
+  }
+
+ private:
+  // Bits of a block, aligned on a cache line.
+  struct alignas(64) Block {
+    Block() {
+      for (auto& item : words) {
+        item.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    std::atomic<uint64_t> words[kBlockBits / 64];
+  };
+
+  // The block is selected by the high bits of a second hash, the bits of
+  // the block by the low bits of the hash.
+  auto block_of(const uint64_t hash) const -> const Block& {
+    return blocks_[((hash * 0x9e3779b97f4a7c15ULL) >> 32) &
+                   (blocks_.size() - 1)];
+  }
+  auto block_of(const uint64_t hash) -> Block& {
+    return blocks_[((hash * 0x9e3779b97f4a7c15ULL) >> 32) &
+                   (blocks_.size() - 1)];
+  }
+
+  auto row_bit(const uint64_t row) const -> size_t {
+    return hash_key(row) & (rows_.size() * kBlockBits - 1);
+  }
+
+  static auto set(Block& block, const size_t bit) -> void {
+    auto mask = uint64_t(1) << (bit % 64);
+    auto& word = block.words[bit / 64];
+    // Most bits are already set once the filter fills: the store is skipped.
+    if ((word.load(std::memory_order_relaxed) & mask) == 0) {
+      word.fetch_or(mask, std::memory_order_relaxed);
+    }
+  }
+
+  static auto test(const Block& block, const size_t bit) -> bool {
+    auto word = block.words[bit / 64].load(std::memory_order_relaxed);
+    return (word >> (bit % 64)) & 1;
+  }
+
+  std::vector<Block> blocks_;
+  std::vector<Block> rows_;
+  size_t capacity_{0};
+  size_t hashes_{1};
+  std::atomic<size_t> count_{0};
+};
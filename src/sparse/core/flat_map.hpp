@@ -0,0 +1,333 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "stats.hpp"
+#include "types.hpp"
+
+// Entry of a hash table.
+template <typename K, typename T>
+struct Entry {
+  K key;
+  T value;
+};
+
+// Entry of a table of booleans: only the keys set to true are stored, no
+// value is allocated.
+template <typename K>
+struct Entry<K, bool> {
+  K key;
+  static constexpr bool value = true;
+};
+
+// Open addressing hash table with linear probing, keyed on packed indices
+// (see "Packing"). Entries are stored inline in a single array of slots: no
+// node is allocated per entry.
+template <typename T, typename K = uint64_t>
+class FlatMap {
+ public:
+  using key_type = K;
+  using mapped_type = T;
+  using Slot = Entry<K, T>;
+
+  // An empty slot is marked by this key. The entry using this key, if any,
+  // is kept in an extra slot stored after the table.
+  static constexpr K kEmpty = empty_key<K>();
+
+  template <typename Map, typename Value>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Value;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Value*;
+    using reference = Value&;
+
+    Iterator(Map* map, size_t ix) : map_(map), ix_(ix) { skip(); }
+
+    auto operator*() const -> reference { return map_->slots_[ix_]; }
+    auto operator->() const -> pointer { return &map_->slots_[ix_]; }
+
+    auto operator++() -> Iterator& {
+      ++ix_;
+      skip();
+      return *this;
+    }
+
+    auto operator==(const Iterator& rhs) const -> bool {
+      return ix_ == rhs.ix_;
+    }
+    auto operator!=(const Iterator& rhs) const -> bool {
+      return ix_ != rhs.ix_;
+    }
+
+   private:
+    auto skip() -> void {
+      while (ix_ < map_->capacity_ && map_->slots_[ix_].key == kEmpty) {
+        ++ix_;
+      }
+      if (ix_ == map_->capacity_ && !map_->has_empty_key_) {
+        ix_ = map_->slots();
+      }
+    }
+
+    Map* map_;
+    size_t ix_;
+  };
+
+  using iterator = Iterator<FlatMap, Slot>;
+  using const_iterator = Iterator<const FlatMap, const Slot>;
+
+  FlatMap() = default;
+
+  FlatMap(const FlatMap& rhs)
+      : slots_(rhs.capacity_ ? new Slot[rhs.capacity_ + 1] : nullptr),
+        capacity_(rhs.capacity_),
+        size_(rhs.size_),
+        has_empty_key_(rhs.has_empty_key_) {
+    std::copy(rhs.slots_.get(), rhs.slots_.get() + slots(), slots_.get());
+  }
+
+  FlatMap(FlatMap&& rhs) noexcept { swap(rhs); }
+
+  auto operator=(FlatMap rhs) noexcept -> FlatMap& {
+    swap(rhs);
+    return *this;
+  }
+
+  auto swap(FlatMap& rhs) noexcept -> void {
+    std::swap(slots_, rhs.slots_);
+    std::swap(capacity_, rhs.capacity_);
+    std::swap(size_, rhs.size_);
+    std::swap(has_empty_key_, rhs.has_empty_key_);
+  }
+
+  static auto hash(const K& key) -> uint64_t { return hash_key(key); }
+
+  auto begin() -> iterator { return iterator(this, 0); }
+  auto end() -> iterator { return iterator(this, slots()); }
+  auto begin() const -> const_iterator { return const_iterator(this, 0); }
+  auto end() const -> const_iterator { return const_iterator(this, slots()); }
+
+  auto size() const -> size_t { return size_; }
+  auto empty() const -> bool { return size_ == 0; }
+  auto capacity() const -> size_t { return capacity_; }
+
+  auto load_factor() const -> double {
+    return capacity_ ? static_cast<double>(size_) / capacity_ : 0;
+  }
+
+  // Number of bytes allocated by the table.
+  auto memory_usage() const -> size_t { return slots() * sizeof(Slot); }
+
+  auto find(const K& key) const -> const T* { return find(key, hash(key)); }
+
+  // Same as above, "hash" being the hash of the key.
+  auto find(const K& key, const uint64_t hash) const -> const T* {
+    auto slot = locate(key, hash);
+    return slot != nullptr ? &slot->value : nullptr;
+  }
+
+  // Hints the processor to load the first slot probed for a key hashed to
+  // "hash", so that a batch of lookups can overlap their cache misses.
+  auto prefetch(const uint64_t hash) const -> void {
+#if defined(__GNUC__) || defined(__clang__)
+    if (capacity_ != 0) {
+      __builtin_prefetch(&slots_[hash & (capacity_ - 1)]);
+    }
+#else
+    static_cast<void>(hash);
+#endif
+  }
+
+  auto find(const K& key) -> T* {
+    auto slot = locate(key, hash(key));
+    return slot != nullptr ? &const_cast<Slot*>(slot)->value : nullptr;
+  }
+
+  auto count(const K& key) const -> size_t {
+    return locate(key, hash(key)) != nullptr ? 1 : 0;
+  }
+
+  auto insert_or_assign(const K& key, const T& value) -> void {
+    (*this)[key] = value;
+  }
+
+  auto operator[](const K& key) -> T& { return emplace(key).value; }
+
+  // Slot of "key", inserted with the value T{} if missing.
+  auto emplace(const K& key) -> Slot& {
+    if (key == kEmpty) {
+      if (capacity_ == 0) {
+        rehash(kMinCapacity);
+      }
+      if (!has_empty_key_) {
+        has_empty_key_ = true;
+        ++size_;
+        slots_[capacity_] = Slot{kEmpty};
+      }
+      return slots_[capacity_];
+    }
+    if ((size_ + 1) * kMaxLoadDen > capacity_ * kMaxLoadNum) {
+      rehash(capacity_ ? capacity_ * 2 : kMinCapacity);
+    }
+    const auto mask = capacity_ - 1;
+    for (auto ix = hash(key) & mask;; ix = (ix + 1) & mask) {
+      auto& slot = slots_[ix];
+      if (slot.key == key) {
+        return slot;
+      }
+      if (slot.key == kEmpty) {
+        ++size_;
+        slot = Slot{key};
+        return slot;
+      }
+    }
+  }
+
+  // Removes the entry "key". Returns false if the key is not stored. The
+  // following entries of the probe sequence are shifted back into the freed
+  // slot, so no tombstone is left behind.
+  auto erase(const K& key) -> bool {
+    if (key == kEmpty) {
+      if (!has_empty_key_) {
+        return false;
+      }
+      has_empty_key_ = false;
+      --size_;
+      return true;
+    }
+    auto slot = locate(key, hash(key));
+    if (slot == nullptr) {
+      return false;
+    }
+    const auto mask = capacity_ - 1;
+    auto hole = static_cast<size_t>(slot - slots_.get());
+    for (auto ix = (hole + 1) & mask; slots_[ix].key != kEmpty;
+         ix = (ix + 1) & mask) {
+      // The entry can fill the hole if the hole lies between its home slot
+      // and its current slot.
+      auto home = hash(slots_[ix].key) & mask;
+      if (((ix - home) & mask) >= ((ix - hole) & mask)) {
+        slots_[hole] = std::move(slots_[ix]);
+        hole = ix;
+      }
+    }
+    slots_[hole].key = kEmpty;
+    --size_;
+    return true;
+  }
+
+  // Removes the entries for which "pred(slot)" is true. Returns the number
+  // of entries removed.
+  template <typename Pred>
+  auto erase_if(const Pred& pred) -> size_t {
+    auto keys = std::vector<K>();
+    for (auto& slot : *this) {
+      if (pred(slot)) {
+        keys.push_back(slot.key);
+      }
+    }
+    for (auto& key : keys) {
+      erase(key);
+    }
+    return keys.size();
+  }
+
+  // Prepares the table to hold at least "n" entries without rehashing.
+  auto reserve(const size_t n) -> void {
+    if (n == 0) {
+      return;
+    }
+    auto capacity = capacity_ ? capacity_ : kMinCapacity;
+    while (n * kMaxLoadDen > capacity * kMaxLoadNum) {
+      capacity *= 2;
+    }
+    if (capacity != capacity_) {
+      rehash(capacity);
+    }
+  }
+
+  // Reduces the capacity of the table to the smallest one holding its
+  // entries.
+  auto shrink_to_fit() -> void {
+    if (size_ == 0) {
+      clear();
+      return;
+    }
+    auto capacity = kMinCapacity;
+    while (size_ * kMaxLoadDen > capacity * kMaxLoadNum) {
+      capacity *= 2;
+    }
+    if (capacity < capacity_) {
+      rehash(capacity);
+    }
+  }
+
+  auto clear() -> void { FlatMap().swap(*this); }
+
+ private:
+  static constexpr size_t kMinCapacity = 16;
+  // The table grows when more than 4/5 of the slots are used.
+  static constexpr size_t kMaxLoadNum = 4;
+  static constexpr size_t kMaxLoadDen = 5;
+
+  auto slots() const -> size_t { return capacity_ ? capacity_ + 1 : 0; }
+
+  auto locate(const K& key, const uint64_t hash) const -> const Slot* {
+    SPARSE_STAT(lookups, 1);
+    if (key == kEmpty) {
+      SPARSE_STAT(hits, has_empty_key_);
+      return has_empty_key_ ? &slots_[capacity_] : nullptr;
+    }
+    if (capacity_ == 0) {
+      return nullptr;
+    }
+    const auto mask = capacity_ - 1;
+    for (auto ix = hash & mask;; ix = (ix + 1) & mask) {
+      SPARSE_STAT(probes, 1);
+      auto& slot = slots_[ix];
+      if (slot.key == key) {
+        SPARSE_STAT(hits, 1);
+        return &slot;
+      }
+      if (slot.key == kEmpty) {
+        return nullptr;
+      }
+    }
+  }
+
+  auto rehash(const size_t capacity) -> void {
+    [[maybe_unused]] auto timer = RehashTimer();
+    std::unique_ptr<Slot[]> slots(new Slot[capacity + 1]);
+    for (size_t ix = 0; ix < capacity; ++ix) {
+      slots[ix].key = kEmpty;
+    }
+    if (has_empty_key_) {
+      slots[capacity] = std::move(slots_[capacity_]);
+    }
+    const auto mask = capacity - 1;
+    for (size_t ix = 0; ix < capacity_; ++ix) {
+      auto& slot = slots_[ix];
+      if (slot.key == kEmpty) {
+        continue;
+      }
+      auto jx = hash(slot.key) & mask;
+      while (slots[jx].key != kEmpty) {
+        jx = (jx + 1) & mask;
+      }
+      slots[jx] = std::move(slot);
+    }
+    slots_ = std::move(slots);
+    capacity_ = capacity;
+  }
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t capacity_{0};
+  size_t size_{0};
+  bool has_empty_key_{false};
+};
@@ -1,11 +1,30 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
 #include <pybind11/stl.h>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "builder.hpp"
+#include "executor.hpp"
+#include "expression.hpp"
+#include "partitioned.hpp"
+#include "scheduler.hpp"
 #include "sparse.hpp"
 
 namespace py = pybind11;
 
+template <typename I>
+using Indices = py::array_t<I, py::array::c_style | py::array::forcecast>;
+template <typename T>
+using Values = py::array_t<T, py::array::c_style | py::array::forcecast>;
+using Offsets =
+    py::array_t<int64_t, py::array::c_style | py::array::forcecast>;
+
 template <typename Array>
 void check_array_ndim(const std::string& name, const int64_t ndim,
                       const Array& a) {
@@ -64,154 +83,1338 @@ void check_ndarray_shape(const std::string& name1, const Array1& a1,
   check_ndarray_shape(name1, a1, args...);
 }
 
-auto parse_tuple(const Matrix::Key& shape, const py::tuple& slices)
-    -> std::tuple<size_t, size_t, size_t, size_t, size_t, size_t, size_t,
-                  size_t> {
+// Selection of the items of an axis of size "size" by a Python slice or
+// index, "limit" being the largest valid index. The type of the item is
+// checked before decoding it to avoid the cost of a failed cast.
+auto parse_index(const py::handle& item, const size_t size, const size_t limit)
+    -> Slice {
+  if (py::isinstance<py::slice>(item)) {
+    size_t start, stop, step, slicelength;
+    if (!py::reinterpret_borrow<py::slice>(item).compute(
+            size, &start, &stop, &step, &slicelength)) {
+      throw py::error_already_set();
+    }
+    return {start, step, slicelength};
+  }
+  if (PyIndex_Check(item.ptr())) {
+    auto index = PyNumber_AsSsize_t(item.ptr(), PyExc_IndexError);
+    if (index == -1 && PyErr_Occurred()) {
+      throw py::error_already_set();
+    }
+    if (index < 0 || static_cast<size_t>(index) > limit) {
+      throw py::index_error("index " + std::to_string(index) +
+                            " is out of bounds");
+    }
+    return {static_cast<size_t>(index), 1, 1};
+  }
+  throw py::type_error("only integers and slices are valid indices");
+}
+
+// Selection of the rows and columns of the matrix by a tuple of Python slices
+// or indices.
+template <typename I>
+auto parse_slices(const std::tuple<I, I>& shape, const py::tuple& slices)
+    -> std::tuple<Slice, Slice> {
   if (slices.size() != 2) {
     throw std::invalid_argument("number of indices must be equal to 2");
   }
-  size_t i_start, i_stop, i_step, i_slicelength;
-  size_t j_start, j_stop, j_step, j_slicelength;
+  // The shape of the matrix, one past its largest indices, must fit in "I".
+  auto limit = static_cast<size_t>(std::numeric_limits<I>::max() - 1);
+  return std::make_tuple(parse_index(slices[0], std::get<0>(shape), limit),
+                         parse_index(slices[1], std::get<1>(shape), limit));
+}
+
+// Wraps "size" items stored in "data" into a NumPy array without copying
+// them, "owner" keeping the buffer alive.
+template <typename T, typename Owner>
+auto as_array(const T* data, const size_t size, std::shared_ptr<Owner> owner)
+    -> py::array_t<T> {
+  auto base = py::capsule(new std::shared_ptr<Owner>(std::move(owner)),
+                          [](void* ptr) {
+                            delete static_cast<std::shared_ptr<Owner>*>(ptr);
+                          });
+  return py::array_t<T>({size}, {sizeof(T)}, data, base);
+}
+
+template <typename T>
+auto as_array(std::vector<T>&& vector) -> py::array_t<T> {
+  auto owner = std::make_shared<std::vector<T>>(std::move(vector));
+  return as_array(owner->data(), owner->size(), owner);
+}
+
+// Values exchanged through a vector of Storage<T>: the bytes holding
+// booleans are viewed as a boolean array.
+template <typename T>
+auto as_values(std::vector<Storage<T>>&& vector) -> py::array {
+  auto result = as_array(std::move(vector));
+  if constexpr (std::is_same<T, bool>::value) {
+    return result.attr("view")(py::dtype::of<bool>())
+        .template cast<py::array>();
+  }
+  return result;
+}
+
+// Signed integers "S" holding the items of "array": the array itself, viewed
+// without copying it, if the types have the same size, a converted copy
+// otherwise. The items are assumed to fit in "S".
+template <typename S, typename U, typename Owner>
+auto as_signed(const Array<U>& array, std::shared_ptr<Owner> owner)
+    -> py::array_t<S> {
+  if constexpr (sizeof(S) == sizeof(U)) {
+    return as_array(reinterpret_cast<const S*>(array.data()), array.size(),
+                    std::move(owner));
+  } else {
+    return as_array(std::vector<S>(array.data(), array.data() + array.size()));
+  }
+}
+
+// Tuple (data, indices, indptr) viewing a compressed storage of a matrix of
+// shape "shape", as expected by the constructors of scipy.sparse.csr_matrix
+// and csc_matrix. The arrays are read-only: they may share the snapshot of a
+// frozen matrix. The data of a boolean matrix, not stored, is filled with
+// true. The indices and offsets have the type SciPy selects for them (see
+// "get_index_dtype"), int32 if the shape and the number of entries fit,
+// int64 otherwise, so that SciPy keeps them without copying: only the arrays
+// stored with another size are converted.
+template <typename T, typename I>
+auto compressed_arrays(std::shared_ptr<const Compressed<T, I>> compressed,
+                       const std::tuple<I, I>& shape) -> py::tuple {
+  auto data = py::array_t<T>();
+  if constexpr (Compressed<T, I>::kPattern) {
+    data = py::array_t<T>(compressed->size());
+    std::fill(data.mutable_data(), data.mutable_data() + data.size(), true);
+  } else {
+    data = as_array(compressed->data.data(), compressed->data.size(),
+                    compressed);
+  }
+  auto bound = std::max<uint64_t>({std::get<0>(shape), std::get<1>(shape),
+                                   compressed->size()});
+  if (bound > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+    throw std::overflow_error("the shape of the matrix does not fit in int64");
+  }
+  auto indices = py::array();
+  auto indptr = py::array();
+  if (bound <= static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+    indices = as_signed<int32_t>(compressed->indices, compressed);
+    indptr = as_signed<int32_t>(compressed->indptr, compressed);
+  } else {
+    indices = as_signed<int64_t>(compressed->indices, compressed);
+    indptr = as_signed<int64_t>(compressed->indptr, compressed);
+  }
+  data.attr("flags").attr("writeable") = false;
+  indices.attr("flags").attr("writeable") = false;
+  indptr.attr("flags").attr("writeable") = false;
+  return py::make_tuple(data, indices, indptr);
+}
+
+// Matrix loaded from a compressed storage (data, indices, indptr).
+template <typename T, typename I>
+auto from_compressed(const Values<T>& data, const Indices<I>& indices,
+                     const Offsets& indptr, const bool csc) -> Matrix<T, I> {
+  check_array_ndim("data", 1, data, "indices", 1, indices, "indptr", 1,
+                   indptr);
+  check_ndarray_shape("data", data, "indices", indices);
+  auto size = static_cast<int64_t>(data.size());
+  if (indptr.size() == 0 || indptr.data()[0] != 0 ||
+      indptr.data()[indptr.size() - 1] != size) {
+    throw std::invalid_argument(
+        "indptr must start at 0 and end at the size of data");
+  }
+  py::gil_scoped_release release;
+  return Matrix<T, I>::from_compressed(
+      indptr.data(), indptr.size() - 1, indices.data(), data.data(),
+      static_cast<size_t>(size), csc);
+}
+
+// Entries (i, j, x) returned by "get", as one array per component.
+template <typename T, typename I>
+struct Entries {
+  std::vector<I> i;
+  std::vector<I> j;
+  std::vector<T> x;
+};
+
+// Entries stored in the window selected by "rows" and "cols", in row-major
+// order.
+template <typename Matrix, typename T, typename I>
+auto window_entries(const Matrix& self, const Slice& rows, const Slice& cols)
+    -> Entries<T, I> {
+  auto result = Entries<T, I>();
+  dispatch_steps(rows, cols, [&](auto unit_rows, auto unit_cols) {
+    self.extract(rows, cols, [&](const size_t ix, const size_t jx, const T x) {
+      result.i.push_back(static_cast<I>(rows.at<unit_rows>(ix)));
+      result.j.push_back(static_cast<I>(cols.at<unit_cols>(jx)));
+      result.x.push_back(x);
+    });
+  });
+  return result;
+}
+
+// Arrays (i, j, x) of entries.
+template <typename T, typename I>
+auto entry_arrays(const Entries<T, I>& entries) -> py::tuple {
+  auto shape = py::array::ShapeContainer({entries.x.size()});
+  auto i = py::array_t<I>(shape);
+  auto j = py::array_t<I>(shape);
+  auto x = py::array_t<T>(shape);
+  std::copy(entries.i.begin(), entries.i.end(), i.mutable_data());
+  std::copy(entries.j.begin(), entries.j.end(), j.mutable_data());
+  std::copy(entries.x.begin(), entries.x.end(), x.mutable_data());
+  return py::make_tuple(i, j, x);
+}
+
+// Axis of a reduction given as None (all the entries, -1) or as an integer.
+auto parse_axis(const py::object& axis) -> int {
+  if (axis.is_none()) {
+    return -1;
+  }
+  auto result = axis.cast<int>();
+  if (result < -2 || result > 1) {
+    throw py::value_error("axis " + std::to_string(result) +
+                          " is out of bounds for array of dimension 2");
+  }
+  return result < 0 ? result + 2 : result;
+}
+
+// Assigns a dense block to the window of a matrix selected by a tuple of
+// slices, see Matrix::set_block.
+template <typename Matrix, typename T>
+auto set_block(Matrix& self, const py::tuple& slices, py::array_t<T>& x,
+               const T absent, const bool erase) -> void {
+  Slice rows, cols;
+  std::tie(rows, cols) = parse_slices(self.shape(), slices);
+
+  if (x.ndim() != 2 || static_cast<size_t>(x.shape(0)) != rows.length ||
+      static_cast<size_t>(x.shape(1)) != cols.length) {
+    throw std::runtime_error("could not broadcast input array from shape " +
+                             ndarray_shape(x) + " into shape (" +
+                             std::to_string(rows.length) + ", " +
+                             std::to_string(cols.length) + ")");
+  }
+  auto strides = std::make_pair(
+      static_cast<ptrdiff_t>(x.strides(0) / static_cast<ssize_t>(sizeof(T))),
+      static_cast<ptrdiff_t>(x.strides(1) / static_cast<ssize_t>(sizeof(T))));
+
+  py::gil_scoped_release release;
+  self.set_block(rows, cols, x.data(), strides, absent, erase);
+}
+
+// Binds the reduction "name(axis=None)" of a matrix, "method" returning the
+// reduced values, of type R: a scalar if "axis" is None, an array otherwise.
+template <typename R, typename Matrix>
+auto bind_reduction(py::class_<Matrix>& cls, const char* name,
+                    std::vector<Storage<R>> (Matrix::*method)(int) const)
+    -> void {
+  cls.def(
+      name,
+      [method](const Matrix& self, const py::object& axis) -> py::object {
+        auto _axis = parse_axis(axis);
+        auto values = std::vector<Storage<R>>();
+        {
+          py::gil_scoped_release release;
+          values = (self.*method)(_axis);
+        }
+        if (_axis == -1) {
+          return py::cast(static_cast<R>(values[0]));
+        }
+        return as_values<R>(std::move(values));
+      },
+      py::arg("axis") = py::none());
+}
+
+// Freezes a matrix in the layout "format": "csr", "csc" or "tiled".
+template <typename Matrix>
+auto freeze(Matrix& self, const std::string& format) -> void {
+  if (format != "csr" && format != "csc" && format != "tiled") {
+    throw std::invalid_argument("format must be 'csr', 'csc' or 'tiled'");
+  }
+  py::gil_scoped_release release;
+  if (format == "tiled") {
+    self.tile();
+  } else {
+    self.freeze(format == "csc");
+  }
+}
+
+// Copies the entries (i, j, x) into a chunk of a builder.
+template <typename T, typename I>
+auto make_chunk(const Indices<I>& i, const Indices<I>& j, const Values<T>& x)
+    -> typename Builder<T, I>::Chunk {
+  check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
+  check_ndarray_shape("i", i, "j", j, "x", x);
+
+  py::gil_scoped_release release;
+  auto result = typename Builder<T, I>::Chunk();
+  auto values = reinterpret_cast<const Storage<T>*>(x.data());
+  result.i.assign(i.data(), i.data() + i.size());
+  result.j.assign(j.data(), j.data() + j.size());
+  result.x.assign(values, values + x.size());
+  return result;
+}
+
+// Executor running the asynchronous methods of the matrices. The requests in
+// flight are completed before the interpreter exits (see PYBIND11_MODULE).
+auto executor() -> Executor& {
+  static auto* result = new Executor(concurrency());
+  return *result;
+}
+
+// Python exception raised for a C++ exception, translated as pybind11 does
+// for the synchronous calls.
+auto python_exception(const std::exception_ptr& exception) -> py::object {
+  auto make = [](PyObject* type, const char* what) -> py::object {
+    return py::reinterpret_borrow<py::object>(type)(what);
+  };
   try {
-    auto index = slices[0].cast<uint32_t>();
-    i_start = index;
-    i_stop = index;
-    i_step = 1;
-    i_slicelength = 1;
-  } catch (py::cast_error) {
-    if (!slices[0].cast<py::slice>().compute(
-            std::get<0>(shape), &i_start, &i_stop, &i_step, &i_slicelength)) {
-      throw py::error_already_set();
+    std::rethrow_exception(exception);
+  } catch (py::error_already_set& error) {
+    return error.value();
+  } catch (const py::index_error& error) {
+    return make(PyExc_IndexError, error.what());
+  } catch (const py::type_error& error) {
+    return make(PyExc_TypeError, error.what());
+  } catch (const py::value_error& error) {
+    return make(PyExc_ValueError, error.what());
+  } catch (const std::invalid_argument& error) {
+    return make(PyExc_ValueError, error.what());
+  } catch (const std::out_of_range& error) {
+    return make(PyExc_IndexError, error.what());
+  } catch (const std::bad_alloc&) {
+    return make(PyExc_MemoryError, "");
+  } catch (const std::exception& error) {
+    return make(PyExc_RuntimeError, error.what());
+  } catch (...) {
+    return make(PyExc_RuntimeError, "unknown error");
+  }
+}
+
+// Requests made by the asynchronous methods of the matrices of type Matrix,
+// resolving concurrent.futures.Future objects. The requests targeting a
+// matrix are run in submission order by a single task of the executor at a
+// time: the consecutive "set" (or "take") requests queued while the previous
+// ones ran are merged into a single bulk call.
+template <typename Matrix, typename T, typename I>
+class Requests {
+ public:
+  enum Kind { kSet, kTake, kGet };
+
+  struct Request {
+    Kind kind;
+    // Arguments of "set" and "take".
+    Indices<I> i;
+    Indices<I> j;
+    Values<T> x;
+    T fill{0};
+    // Result of "take", written through "output".
+    py::array_t<T> result;
+    T* output{nullptr};
+    // Window read by "get", and its entries.
+    Slice rows{0, 1, 0};
+    Slice cols{0, 1, 0};
+    Entries<T, I> entries;
+
+    py::object owner;
+    py::object future;
+    std::exception_ptr error;
+  };
+
+  static auto instance() -> Requests& {
+    static auto* result = new Requests();
+    return *result;
+  }
+
+  // Queues a request on the matrix "owner", returning its future.
+  auto submit(const py::object& owner, Request request) -> py::object {
+    auto* matrix = &owner.cast<Matrix&>();
+    auto future = py::module::import("concurrent.futures").attr("Future")();
+    request.owner = owner;
+    request.future = future;
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto it = pending_.find(matrix);
+    if (it == pending_.end()) {
+      executor().submit([this, matrix]() { drain(matrix); });
+      it = pending_.emplace(matrix, std::vector<Request>()).first;
     }
+    it->second.push_back(std::move(request));
+    return future;
   }
 
-  try {
-    auto index = slices[1].cast<uint32_t>();
-    j_start = index;
-    j_stop = index;
-    j_step = 1;
-    j_slicelength = 1;
-  } catch (py::cast_error) {
-    if (!slices[1].cast<py::slice>().compute(
-            std::get<1>(shape), &j_start, &j_stop, &j_step, &j_slicelength)) {
-      throw py::error_already_set();
+ private:
+  Requests() = default;
+
+  // Runs the requests queued on a matrix until there are none left.
+  auto drain(Matrix* matrix) -> void {
+    while (true) {
+      auto batch = std::vector<Request>();
+      {
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        auto it = pending_.find(matrix);
+        if (it->second.empty()) {
+          pending_.erase(it);
+          return;
+        }
+        batch.swap(it->second);
+      }
+      run(*matrix, batch);
+    }
+  }
+
+  // Runs a batch of requests and resolves their futures. The batch, holding
+  // Python objects, is released with the GIL held.
+  auto run(Matrix& matrix, std::vector<Request>& batch) -> void {
+    try {
+      {
+        py::gil_scoped_acquire acquire;
+        // The requests cancelled while queued are dropped.
+        batch.erase(std::remove_if(batch.begin(), batch.end(),
+                                   [](const Request& item) {
+                                     return !item.future
+                                                 .attr("set_running_or_"
+                                                       "notify_cancel")()
+                                                 .template cast<bool>();
+                                   }),
+                    batch.end());
+      }
+      for (size_t first = 0; first < batch.size();) {
+        auto last = first + 1;
+        while (last < batch.size() && mergeable(batch[first], batch[last])) {
+          ++last;
+        }
+        try {
+          execute(matrix, batch, first, last);
+        } catch (...) {
+          for (auto ix = first; ix < last; ++ix) {
+            batch[ix].error = std::current_exception();
+          }
+        }
+        first = last;
+      }
+
+      py::gil_scoped_acquire acquire;
+      for (auto& item : batch) {
+        if (item.error) {
+          item.future.attr("set_exception")(python_exception(item.error));
+        } else if (item.kind == kSet) {
+          item.future.attr("set_result")(py::none());
+        } else if (item.kind == kTake) {
+          item.future.attr("set_result")(item.result);
+        } else {
+          item.future.attr("set_result")(entry_arrays(item.entries));
+        }
+      }
+      batch.clear();
+    } catch (py::error_already_set& error) {
+      py::gil_scoped_acquire acquire;
+      error.discard_as_unraisable(__func__);
+      batch.clear();
+    }
+  }
+
+  static auto mergeable(const Request& lhs, const Request& rhs) -> bool {
+    return lhs.kind == rhs.kind &&
+           (lhs.kind == kSet || (lhs.kind == kTake && lhs.fill == rhs.fill));
+  }
+
+  // Runs the requests [first, last) of a batch, all of the same kind.
+  static auto execute(Matrix& matrix, std::vector<Request>& batch,
+                      const size_t first, const size_t last) -> void {
+    auto& head = batch[first];
+    if (head.kind == kGet) {
+      head.entries = window_entries<Matrix, T, I>(matrix, head.rows, head.cols);
+      return;
+    }
+    if (last - first == 1) {
+      if (head.kind == kSet) {
+        matrix.set(head.i.data(), head.j.data(), head.x.data(), head.x.size());
+      } else {
+        matrix.take(head.i.data(), head.j.data(), head.i.size(), head.fill,
+                    head.output);
+      }
+      return;
+    }
+
+    auto size = size_t(0);
+    for (auto ix = first; ix < last; ++ix) {
+      size += batch[ix].i.size();
+    }
+    auto i = std::vector<I>();
+    auto j = std::vector<I>();
+    auto x = std::vector<Storage<T>>();
+    i.reserve(size);
+    j.reserve(size);
+    for (auto ix = first; ix < last; ++ix) {
+      auto& item = batch[ix];
+      i.insert(i.end(), item.i.data(), item.i.data() + item.i.size());
+      j.insert(j.end(), item.j.data(), item.j.data() + item.j.size());
+      if (head.kind == kSet) {
+        auto values = reinterpret_cast<const Storage<T>*>(item.x.data());
+        x.insert(x.end(), values, values + item.x.size());
+      }
+    }
+    if (head.kind == kSet) {
+      matrix.set(i.data(), j.data(), reinterpret_cast<const T*>(x.data()),
+                 size);
+      return;
+    }
+    x.resize(size);
+    matrix.take(i.data(), j.data(), size, head.fill,
+                reinterpret_cast<T*>(x.data()));
+    auto offset = size_t(0);
+    for (auto ix = first; ix < last; ++ix) {
+      auto& item = batch[ix];
+      std::memcpy(item.output, x.data() + offset, item.i.size() * sizeof(T));
+      offset += item.i.size();
+    }
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<Matrix*, std::vector<Request>> pending_;
+};
+
+// Binds the builder of the matrices of values of type T, indexed by integers
+// of type I.
+template <typename T, typename I>
+auto bind_builder(py::module& m, const char* name) -> void {
+  using Builder = ::Builder<T, I>;
+  using Indices = ::Indices<I>;
+  using Values = ::Values<T>;
+
+  py::class_<Builder>(m, name)
+      .def(py::init<size_t, bool>(), py::arg("expected_nnz") = 0,
+           py::arg("accumulate") = false)
+      .def(
+          "append",
+          [](Builder& self, const Indices& i, const Indices& j,
+             const Values& x) {
+            auto chunk = make_chunk<T, I>(i, j, x);
+            py::gil_scoped_release release;
+            self.append(std::move(chunk));
+          },
+          py::arg("i"), py::arg("j"), py::arg("x"))
+      .def(
+          "extend",
+          [](Builder& self, const py::iterable& chunks) {
+            // The next chunk is produced by the iterator while the previous
+            // one is inserted.
+            for (auto item : chunks) {
+              auto tuple = item.template cast<py::tuple>();
+              if (tuple.size() != 3) {
+                throw std::invalid_argument(
+                    "chunks must be tuples of arrays (i, j, x)");
+              }
+              auto chunk = make_chunk<T, I>(tuple[0].template cast<Indices>(),
+                                            tuple[1].template cast<Indices>(),
+                                            tuple[2].template cast<Values>());
+              py::gil_scoped_release release;
+              self.append(std::move(chunk));
+            }
+          },
+          py::arg("chunks"))
+      .def(
+          "finalize",
+          [](Builder& self, const py::object& format) {
+            auto result = ::Matrix<T, I>();
+            {
+              py::gil_scoped_release release;
+              result = self.finalize();
+            }
+            if (!format.is_none()) {
+              freeze(result, format.cast<std::string>());
+            }
+            return result;
+          },
+          py::arg("format") = py::none());
+}
+
+// Iterator over the entries of a sorted storage (see "Matrix::sorted"),
+// yielding chunks (i, j, x) of at most "chunk_size" entries. The entries are
+// those of the matrix when the iterator was created.
+template <typename T, typename I>
+class Items {
+ public:
+  using Compressed = ::Compressed<T, I>;
+
+  // "csc" is true if the major indices of the storage are the columns of the
+  // matrix.
+  Items(std::shared_ptr<const Compressed> storage, const bool csc,
+        const size_t chunk_size)
+      : storage_(std::move(storage)), csc_(csc), chunk_size_(chunk_size) {}
+
+  auto next() -> py::tuple {
+    auto n = std::min(chunk_size_, storage_->size() - position_);
+    if (n == 0) {
+      throw py::stop_iteration();
+    }
+    auto majors = py::array_t<I>(n);
+    auto minors = py::array_t<I>(n);
+    auto x = py::array_t<T>(n);
+    auto _majors = majors.mutable_data();
+    auto _minors = minors.mutable_data();
+    auto _x = x.mutable_data();
+    {
+      py::gil_scoped_release release;
+      auto& storage = *storage_;
+      std::memcpy(_minors, storage.indices.data() + position_, n * sizeof(I));
+      if constexpr (Compressed::kPattern) {
+        std::fill(_x, _x + n, true);
+      } else {
+        std::memcpy(_x, storage.data.data() + position_, n * sizeof(T));
+      }
+      for (auto last = position_ + n; position_ < last;) {
+        while (storage.indptr[segment_ + 1] == position_) {
+          ++segment_;
+        }
+        auto end = std::min<size_t>(storage.indptr[segment_ + 1], last);
+        auto major = storage.hypersparse() ? storage.majors[segment_]
+                                           : static_cast<I>(segment_);
+        std::fill(_majors, _majors + (end - position_), major);
+        _majors += end - position_;
+        position_ = end;
+      }
     }
+    if (csc_) {
+      return py::make_tuple(minors, majors, x);
+    }
+    return py::make_tuple(majors, minors, x);
   }
 
-  return std::make_tuple(i_start, i_stop, i_step, i_slicelength, j_start,
-                         j_stop, j_step, j_slicelength);
+ private:
+  std::shared_ptr<const Compressed> storage_;
+  bool csc_;
+  size_t chunk_size_;
+  // Next entry, and its segment.
+  size_t position_{0};
+  size_t segment_{0};
+};
+
+// Binds the iterator over the entries of the matrices of values of type T,
+// indexed by integers of type I.
+template <typename T, typename I>
+auto bind_items(py::module& m, const char* name) -> void {
+  using Items = ::Items<T, I>;
+
+  py::class_<Items>(m, name)
+      .def(
+          "__iter__", [](Items& self) -> Items& { return self; },
+          py::return_value_policy::reference_internal)
+      .def("__next__", &Items::next);
 }
 
-PYBIND11_MODULE(core, m) {
-  py::class_<Matrix>(m, "Matrix")
-      .def(py::init<>())
-      .def("transpose", &Matrix::transpose)
-      .def_property_readonly("shape", &Matrix::shape)
+// Binds the matrix of values of type T split into shards of rows (see
+// partitioned.hpp).
+template <typename T, typename I>
+auto bind_partitioned(py::module& m, const char* name) -> void {
+  using Partitioned = ::Partitioned<T, I>;
+  using Matrix = ::Matrix<T, I>;
+  using Indices = ::Indices<I>;
+  using Values = ::Values<T>;
+
+  py::class_<Partitioned>(m, name)
+      .def(py::init<std::vector<uint64_t>>(), py::arg("bounds"))
+      // Matrix made of the matrices "shards", the shard "s" holding the rows
+      // [bounds[s], bounds[s + 1]) indexed from 0.
+      .def(py::init<std::vector<uint64_t>, std::vector<Matrix>>(),
+           py::arg("bounds"), py::arg("shards"))
+      .def_static("split", &Partitioned::split, py::arg("rows"),
+                  py::arg("shards"))
+      .def_property_readonly_static(
+          "dtype", [](const py::object&) { return py::dtype::of<T>(); })
+      .def_property_readonly_static(
+          "index_dtype", [](const py::object&) { return py::dtype::of<I>(); })
+      .def_property_readonly("bounds", &Partitioned::bounds)
+      .def_property_readonly("num_shards", &Partitioned::size)
+      // Copy of a shard, sharing its storage until one of them is modified.
+      .def(
+          "shard",
+          [](const Partitioned& self, const size_t s) {
+            return Matrix(self.shard(s));
+          },
+          py::arg("s"), py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("shape",
+                             [](const Partitioned& self) {
+                               py::gil_scoped_release release;
+                               return self.shape();
+                             })
+      .def_property_readonly("nnz",
+                             [](const Partitioned& self) {
+                               py::gil_scoped_release release;
+                               return self.nnz();
+                             })
+      .def_property_readonly("nbytes",
+                             [](const Partitioned& self) {
+                               py::gil_scoped_release release;
+                               return self.nbytes();
+                             })
+      .def(
+          "freeze",
+          [](Partitioned& self, const std::string& format) {
+            freeze(self, format);
+          },
+          py::arg("format") = "csr")
+      .def("thaw", &Partitioned::thaw,
+           py::call_guard<py::gil_scoped_release>())
+      .def("save", &Partitioned::save, py::arg("path"),
+           py::call_guard<py::gil_scoped_release>())
+      .def_static("load", &Partitioned::load, py::arg("path"),
+                  py::arg("mmap") = true, py::arg("validate") = false,
+                  py::call_guard<py::gil_scoped_release>())
+      .def(py::pickle(
+          [](const Partitioned& self) {
+            auto shards = py::list();
+            for (size_t sx = 0; sx < self.size(); ++sx) {
+              auto state = std::string();
+              {
+                py::gil_scoped_release release;
+                state = self.shard(sx).dumps();
+              }
+              shards.append(py::bytes(state));
+            }
+            return py::make_tuple(self.bounds(), shards);
+          },
+          [](const py::tuple& state) {
+            if (state.size() != 2) {
+              throw std::runtime_error("invalid state");
+            }
+            auto shards = std::vector<Matrix>();
+            for (auto item : state[1].cast<py::list>()) {
+              auto buffer = item.template cast<py::bytes>();
+              char* data;
+              Py_ssize_t size;
+              if (PyBytes_AsStringAndSize(buffer.ptr(), &data, &size) != 0) {
+                throw py::error_already_set();
+              }
+              py::gil_scoped_release release;
+              shards.push_back(Matrix::loads(data, static_cast<size_t>(size)));
+            }
+            return Partitioned(state[0].cast<std::vector<uint64_t>>(),
+                               std::move(shards));
+          }))
       .def(
           "set",
-          [](Matrix& self, py::array_t<uint32_t> i, py::array_t<uint32_t> j,
-             py::array_t<double> x) {
+          [](Partitioned& self, const Indices& i, const Indices& j,
+             const Values& x) {
+            check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
+            check_ndarray_shape("i", i, "j", j, "x", x);
+
+            py::gil_scoped_release release;
+            self.set(i.data(), j.data(), x.data(), x.size());
+          },
+          py::arg("i"), py::arg("j"), py::arg("x"))
+      .def(
+          "add",
+          [](Partitioned& self, const Indices& i, const Indices& j,
+             const Values& x) {
             check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
             check_ndarray_shape("i", i, "j", j, "x", x);
-            auto _i = i.unchecked<1>();
-            auto _j = j.unchecked<1>();
-            auto _x = x.unchecked<1>();
 
-            for (auto ix = 0; ix < x.size(); ++ix) {
-              self.set({_i[ix], _j[ix]}, _x[ix]);
+            py::gil_scoped_release release;
+            self.add(i.data(), j.data(), x.data(), x.size());
+          },
+          py::arg("i"), py::arg("j"), py::arg("x"))
+      .def(
+          "erase",
+          [](Partitioned& self, const Indices& i, const Indices& j) {
+            check_array_ndim("i", 1, i, "j", 1, j);
+            check_ndarray_shape("i", i, "j", j);
+
+            py::gil_scoped_release release;
+            self.erase(i.data(), j.data(), i.size());
+          },
+          py::arg("i"), py::arg("j"))
+      .def(
+          "take",
+          [](const Partitioned& self, const Indices& i, const Indices& j,
+             const T fill) -> py::array_t<T> {
+            check_ndarray_shape("i", i, "j", j);
+            auto x = py::array_t<T>(
+                std::vector<py::ssize_t>(i.shape(), i.shape() + i.ndim()));
+            auto _x = x.mutable_data();
+
+            py::gil_scoped_release release;
+            self.take(i.data(), j.data(), i.size(), fill, _x);
+            return x;
+          },
+          py::arg("i"), py::arg("j"), py::arg("fill") = T(0))
+      .def(
+          "dot",
+          [](const Partitioned& self,
+             const ::Values<double>& x) -> py::array_t<double> {
+            if (x.ndim() != 1 && x.ndim() != 2) {
+              throw std::invalid_argument(
+                  "x must be a 1-dimensional or 2-dimensional array");
             }
+            auto shape = self.shape();
+            auto rows = static_cast<size_t>(std::get<0>(shape));
+            auto cols = static_cast<size_t>(std::get<1>(shape));
+            if (static_cast<size_t>(x.shape(0)) != cols) {
+              throw std::invalid_argument(
+                  "shapes (" + std::to_string(rows) + ", " +
+                  std::to_string(cols) + ") and " + ndarray_shape(x) +
+                  " not aligned");
+            }
+            auto k =
+                x.ndim() == 1 ? size_t(1) : static_cast<size_t>(x.shape(1));
+            auto result = x.ndim() == 1 ? py::array_t<double>(rows)
+                                        : py::array_t<double>({rows, k});
+            auto y = result.mutable_data();
+            std::fill(y, y + result.size(), 0.0);
+
+            py::gil_scoped_release release;
+            self.dot(x.data(), cols, k, y, rows);
+            return result;
+          },
+          py::arg("x"))
+      // Single entries, indexed by a tuple of two integers.
+      .def("__getitem__",
+           [](const Partitioned& self, const std::tuple<I, I>& key) {
+             py::gil_scoped_release release;
+             return self.get(key);
+           })
+      .def("__setitem__",
+           [](Partitioned& self, const std::tuple<I, I>& key, const T x) {
+             py::gil_scoped_release release;
+             self.set(key, x);
+           });
+}
+
+// Binds the lazy expression of matrices of values of type T (see
+// expression.hpp).
+template <typename T, typename I>
+auto bind_expression(py::module& m, const char* name) -> void {
+  using Expression = ::Expression<T, I>;
+  using Matrix = ::Matrix<T, I>;
+
+  auto cls = py::class_<Expression>(m, name);
+  cls.def(py::init<const Matrix&>(), py::arg("matrix"),
+          py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("T", &Expression::transposed)
+      .def_property_readonly("shape", &Expression::shape)
+      .def("evaluate", &Expression::evaluate,
+           py::call_guard<py::gil_scoped_release>())
+      .def("__add__", &Expression::plus, py::arg("other"), py::is_operator())
+      .def(
+          "__add__",
+          [](const Expression& self, const Matrix& other) {
+            return self.plus(Expression(other));
+          },
+          py::arg("other"), py::is_operator(),
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "__radd__",
+          [](const Expression& self, const Matrix& other) {
+            return Expression(other).plus(self);
+          },
+          py::arg("other"), py::is_operator(),
+          py::call_guard<py::gil_scoped_release>())
+      .def("__mul__", &Expression::multiply, py::arg("other"),
+           py::is_operator())
+      .def(
+          "__mul__",
+          [](const Expression& self, const Matrix& other) {
+            return self.multiply(Expression(other));
+          },
+          py::arg("other"), py::is_operator(),
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "__rmul__",
+          [](const Expression& self, const Matrix& other) {
+            return Expression(other).multiply(self);
+          },
+          py::arg("other"), py::is_operator(),
+          py::call_guard<py::gil_scoped_release>());
+  bind_reduction<typename Expression::Sum>(cls, "sum", &Expression::sum);
+  bind_reduction<int64_t>(cls, "count_nonzero", &Expression::count_nonzero);
+  bind_reduction<double>(cls, "mean", &Expression::mean);
+  bind_reduction<T>(cls, "max", &Expression::max);
+  bind_reduction<T>(cls, "min", &Expression::min);
+}
+
+// NumPy code ("f8", "u4", ...) of a type given as a NumPy dtype or any
+// object accepted by numpy.dtype.
+auto dtype_code(const py::object& dtype) -> std::string {
+  auto type = py::dtype::from_args(dtype);
+  return std::string(1, type.kind()) + std::to_string(type.itemsize());
+}
+
+// Registers the matrix of values of type T, indexed by integers of type I,
+// in "types", keyed by the NumPy codes of T and I. "builder", "items" and
+// "partitioned" are the names of the classes of its builders, of its
+// iterators and of its partitioned variant.
+template <typename T, typename I>
+auto bind_matrix(py::module& m, const char* name, const char* builder,
+                 const char* items, const char* partitioned,
+                 const char* expression, py::dict& types) -> void {
+  using Matrix = ::Matrix<T, I>;
+  using Indices = ::Indices<I>;
+  using Values = ::Values<T>;
+  using Requests = ::Requests<Matrix, T, I>;
+
+  bind_builder<T, I>(m, builder);
+  bind_items<T, I>(m, items);
+  bind_expression<T, I>(m, expression);
+  auto cls = py::class_<Matrix>(m, name);
+  types[py::make_tuple(type_code<T>(), type_code<I>())] = cls;
+  cls.def(py::init<>())
+      .def_property_readonly_static(
+          "dtype", [](const py::object&) { return py::dtype::of<T>(); })
+      .def_property_readonly_static(
+          "index_dtype", [](const py::object&) { return py::dtype::of<I>(); })
+      .def("transpose", &Matrix::transpose,
+           py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("T",
+                             [](const Matrix& self) {
+                               py::gil_scoped_release release;
+                               return self.transposed();
+                             })
+      .def(
+          "copy", [](const Matrix& self) { return Matrix(self); },
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "__copy__", [](const Matrix& self) { return Matrix(self); },
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "__deepcopy__",
+          [](const Matrix& self, const py::dict&) { return Matrix(self); },
+          py::arg("memo"))
+      .def_property_readonly("shape",
+                             [](const Matrix& self) {
+                               py::gil_scoped_release release;
+                               return self.shape();
+                             })
+      .def_property_readonly("nnz",
+                             [](const Matrix& self) {
+                               py::gil_scoped_release release;
+                               return self.nnz();
+                             })
+      .def_property_readonly("nbytes",
+                             [](const Matrix& self) {
+                               py::gil_scoped_release release;
+                               return self.nbytes();
+                             })
+      .def("memory_usage",
+           [](const Matrix& self) {
+             auto usage = typename Matrix::MemoryUsage();
+             {
+               py::gil_scoped_release release;
+               usage = self.memory_usage();
+             }
+             auto result = py::dict();
+             result["object"] = usage.object;
+             result["entries"] = usage.entries;
+             result["slack"] = usage.slack;
+             result["indptr"] = usage.indptr;
+             result["majors"] = usage.majors;
+             result["indices"] = usage.indices;
+             result["data"] = usage.data;
+             result["tiles"] = usage.tiles;
+             result["sorted"] = usage.sorted;
+             result["filter"] = usage.filter;
+             result["total"] = usage.total();
+             return result;
+           })
+      .def(
+          "stats",
+          [](const Matrix& self, const bool reset) {
+            auto stats = Stats();
+            auto load_factor = 0.0;
+            {
+              py::gil_scoped_release release;
+              stats = self.stats(reset);
+              load_factor = self.load_factor();
+            }
+            auto ratio = [](const uint64_t lhs, const uint64_t rhs) {
+              return rhs ? static_cast<double>(lhs) / rhs : 0.0;
+            };
+            auto result = py::dict();
+            result["enabled"] = kStats;
+            result["lookups"] = stats.lookups;
+            result["hits"] = stats.hits;
+            result["misses"] = stats.lookups - stats.hits;
+            result["mean_probe_length"] = ratio(stats.probes, stats.lookups);
+            result["rehashes"] = stats.rehashes;
+            result["rehash_seconds"] = stats.rehash_ns * 1e-9;
+            result["load_factor"] = load_factor;
+            result["cells_visited"] = stats.cells;
+            result["entries_returned"] = stats.returned;
+            result["scan_efficiency"] = ratio(stats.returned, stats.cells);
+            result["filtered"] = stats.filtered;
+            return result;
+          },
+          py::arg("reset") = false)
+      .def_property_readonly("frozen",
+                             [](const Matrix& self) {
+                               py::gil_scoped_release release;
+                               return self.frozen();
+                             })
+      .def(
+          "freeze",
+          [](Matrix& self, const std::string& format) {
+            freeze(self, format);
+          },
+          py::arg("format") = "csr")
+      .def("thaw", &Matrix::thaw, py::call_guard<py::gil_scoped_release>())
+      .def_static(
+          "builder",
+          [](const size_t expected_nnz, const bool accumulate) {
+            return std::make_unique<::Builder<T, I>>(expected_nnz, accumulate);
+          },
+          py::arg("expected_nnz") = 0, py::arg("accumulate") = false)
+      .def("to_coo",
+           [](const Matrix& self) -> py::tuple {
+             std::vector<I> i, j;
+             std::vector<Storage<T>> x;
+             {
+               py::gil_scoped_release release;
+               std::tie(i, j, x) = self.coo();
+             }
+             return py::make_tuple(as_values<T>(std::move(x)),
+                                   py::make_tuple(as_array(std::move(i)),
+                                                  as_array(std::move(j))));
+           })
+      .def("to_csr",
+           [](const Matrix& self) -> py::tuple {
+             std::shared_ptr<const Compressed<T, I>> compressed;
+             std::tuple<I, I> shape;
+             {
+               py::gil_scoped_release release;
+               compressed = self.compressed(false);
+               // The shape is read after the storage: it bounds its indices.
+               shape = self.shape();
+             }
+             return compressed_arrays(std::move(compressed), shape);
+           })
+      .def("to_csc",
+           [](const Matrix& self) -> py::tuple {
+             std::shared_ptr<const Compressed<T, I>> compressed;
+             std::tuple<I, I> shape;
+             {
+               py::gil_scoped_release release;
+               compressed = self.compressed(true);
+               shape = self.shape();
+             }
+             return compressed_arrays(std::move(compressed), shape);
+           })
+      .def_static(
+          "from_coo",
+          [](const Indices& i, const Indices& j, const Values& x) {
+            check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
+            check_ndarray_shape("i", i, "j", j, "x", x);
+
+            py::gil_scoped_release release;
+            auto result = Matrix();
+            result.add(i.data(), j.data(), x.data(), x.size());
+            return result;
           },
           py::arg("i"), py::arg("j"), py::arg("x"))
+      .def_static(
+          "from_csr",
+          [](const Values& data, const Indices& indices,
+             const Offsets& indptr) {
+            return from_compressed<T, I>(data, indices, indptr, false);
+          },
+          py::arg("data"), py::arg("indices"), py::arg("indptr"))
+      .def_static(
+          "from_csc",
+          [](const Values& data, const Indices& indices,
+             const Offsets& indptr) {
+            return from_compressed<T, I>(data, indices, indptr, true);
+          },
+          py::arg("data"), py::arg("indices"), py::arg("indptr"))
+      .def("save", &Matrix::save, py::arg("path"),
+           py::call_guard<py::gil_scoped_release>())
+      .def_static("load", &Matrix::load, py::arg("path"),
+                  py::arg("mmap") = true, py::arg("validate") = false,
+                  py::call_guard<py::gil_scoped_release>())
+      .def(py::pickle(
+          [](const Matrix& self) {
+            auto state = std::string();
+            {
+              py::gil_scoped_release release;
+              state = self.dumps();
+            }
+            return py::make_tuple(py::bytes(state));
+          },
+          [](const py::tuple& state) {
+            if (state.size() != 1) {
+              throw std::runtime_error("invalid state");
+            }
+            auto buffer = state[0].cast<py::bytes>();
+            char* data;
+            Py_ssize_t size;
+            if (PyBytes_AsStringAndSize(buffer.ptr(), &data, &size) != 0) {
+              throw py::error_already_set();
+            }
+            py::gil_scoped_release release;
+            return Matrix::loads(data, static_cast<size_t>(size));
+          }))
+      .def(
+          "set",
+          [](Matrix& self, const Indices& i, const Indices& j,
+             const Values& x) {
+            check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
+            check_ndarray_shape("i", i, "j", j, "x", x);
+
+            py::gil_scoped_release release;
+            self.set(i.data(), j.data(), x.data(), x.size());
+          },
+          py::arg("i"), py::arg("j"), py::arg("x"))
+      .def(
+          "add",
+          [](Matrix& self, const Indices& i, const Indices& j,
+             const Values& x) {
+            check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
+            check_ndarray_shape("i", i, "j", j, "x", x);
+
+            py::gil_scoped_release release;
+            self.add(i.data(), j.data(), x.data(), x.size());
+          },
+          py::arg("i"), py::arg("j"), py::arg("x"))
+      .def(
+          "erase",
+          [](Matrix& self, const Indices& i, const Indices& j) {
+            check_array_ndim("i", 1, i, "j", 1, j);
+            check_ndarray_shape("i", i, "j", j);
+
+            py::gil_scoped_release release;
+            self.erase(i.data(), j.data(), i.size());
+          },
+          py::arg("i"), py::arg("j"))
+      .def("prune", &Matrix::prune, py::arg("tolerance") = 0.0,
+           py::call_guard<py::gil_scoped_release>())
+      .def("compact", &Matrix::compact,
+           py::call_guard<py::gil_scoped_release>())
+      // Occupancy filter rejecting most lookups of entries not stored, using
+      // about "bits_per_entry" bits per entry; 0 disables it.
+      .def("set_filter", &Matrix::set_filter, py::arg("bits_per_entry") = 8.0,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "dot",
+          [](const Matrix& self,
+             const ::Values<double>& x) -> py::array_t<double> {
+            if (x.ndim() != 1 && x.ndim() != 2) {
+              throw std::invalid_argument(
+                  "x must be a 1-dimensional or 2-dimensional array");
+            }
+            auto shape = self.shape();
+            auto rows = static_cast<size_t>(std::get<0>(shape));
+            auto cols = static_cast<size_t>(std::get<1>(shape));
+            if (static_cast<size_t>(x.shape(0)) != cols) {
+              throw std::invalid_argument(
+                  "shapes (" + std::to_string(rows) + ", " +
+                  std::to_string(cols) + ") and " + ndarray_shape(x) +
+                  " not aligned");
+            }
+            auto k =
+                x.ndim() == 1 ? size_t(1) : static_cast<size_t>(x.shape(1));
+            auto result = x.ndim() == 1 ? py::array_t<double>(rows)
+                                        : py::array_t<double>({rows, k});
+            auto y = result.mutable_data();
+            std::fill(y, y + result.size(), 0.0);
+
+            py::gil_scoped_release release;
+            self.dot(x.data(), cols, k, y, rows);
+            return result;
+          },
+          py::arg("x"))
+      .def("__add__", &Matrix::plus, py::arg("other"),
+           py::is_operator(), py::call_guard<py::gil_scoped_release>())
+      .def("__mul__", &Matrix::multiply, py::arg("other"),
+           py::is_operator(), py::call_guard<py::gil_scoped_release>())
+      .def("__matmul__", &Matrix::matmul, py::arg("other"),
+           py::is_operator(), py::call_guard<py::gil_scoped_release>())
+      // Lazy expression of the matrix: the sums, products and reductions of
+      // expressions are computed in a single pass, without intermediate
+      // matrices.
+      .def(
+          "lazy", [](const Matrix& self) { return Expression<T, I>(self); },
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "take",
+          [](const Matrix& self, const Indices& i, const Indices& j,
+             const T fill) -> py::array_t<T> {
+            check_ndarray_shape("i", i, "j", j);
+            auto x = py::array_t<T>(
+                std::vector<py::ssize_t>(i.shape(), i.shape() + i.ndim()));
+            auto _x = x.mutable_data();
+
+            py::gil_scoped_release release;
+            self.take(i.data(), j.data(), i.size(), fill, _x);
+            return x;
+          },
+          py::arg("i"), py::arg("j"), py::arg("fill") = T(0))
+      // Entries in row-major ("row") or column-major ("col") order, by
+      // chunks (i, j, x) of at most "chunk_size" entries. The entries are
+      // sorted once, until the next modification of the matrix.
+      .def(
+          "items",
+          [](const Matrix& self, const std::string& order,
+             const size_t chunk_size) {
+            if (order != "row" && order != "col") {
+              throw std::invalid_argument("order must be 'row' or 'col'");
+            }
+            if (chunk_size == 0) {
+              throw std::invalid_argument("chunk_size must be positive");
+            }
+            auto csc = order == "col";
+            std::shared_ptr<const Compressed<T, I>> storage;
+            {
+              py::gil_scoped_release release;
+              storage = self.sorted(csc);
+            }
+            return ::Items<T, I>(std::move(storage), csc, chunk_size);
+          },
+          py::arg("order") = "row", py::arg("chunk_size") = 1 << 16)
       .def("get",
            [](const Matrix& self, const py::tuple& slices) -> py::tuple {
-             size_t i_start, i_stop, i_step, i_slicelength;
-             size_t j_start, j_stop, j_step, j_slicelength;
-             auto shape = self.shape();
-
-             std::tie(i_start, i_stop, i_step, i_slicelength, j_start, j_stop,
-                      j_step, j_slicelength) = parse_tuple(shape, slices);
-
-             auto result_shape =
-                 py::array::ShapeContainer({i_slicelength * j_slicelength});
-             auto i = py::array_t<uint32_t>(result_shape);
-             auto j = py::array_t<uint32_t>(result_shape);
-             auto x = py::array_t<double>(result_shape);
-             auto _i = i.mutable_unchecked<1>();
-             auto _j = j.mutable_unchecked<1>();
-             auto _x = x.mutable_unchecked<1>();
-             auto k = 0ULL;
-
-             for (size_t ix = 0; ix < i_slicelength; ++ix) {
-               auto start = j_start;
-               for (size_t jx = 0; jx < j_slicelength; ++jx) {
-                 auto data = self.get({i_start, start}, true);
-                 if (!std::isnan(data)) {
-                   _i(k) = i_start;
-                   _j(k) = start;
-                   _x(k) = data;
-                   ++k;
-                 }
-                 start += j_step;
-               }
-               i_start += i_step;
+             Slice rows, cols;
+             std::tie(rows, cols) = parse_slices(self.shape(), slices);
+
+             auto entries = Entries<T, I>();
+             {
+               py::gil_scoped_release release;
+               entries = window_entries<Matrix, T, I>(self, rows, cols);
              }
-             i.resize({k});
-             j.resize({k});
-             x.resize({k});
-             return py::make_tuple(i, j, x);
+             return entry_arrays(entries);
            })
-      .def("__setitem__",
-           [](Matrix& self, const py::tuple& slices,
-              py::array_t<double>& x) -> void {
-             size_t i_start, i_stop, i_step, i_slicelength;
-             size_t j_start, j_stop, j_step, j_slicelength;
-             auto shape = self.shape();
-
-             std::tie(i_start, i_stop, i_step, i_slicelength, j_start, j_stop,
-                      j_step, j_slicelength) = parse_tuple(shape, slices);
-
-             if (x.ndim() != 2 ||
-                 static_cast<size_t>(x.shape(0)) != i_slicelength ||
-                 static_cast<size_t>(x.shape(1)) != j_slicelength) {
-               throw std::runtime_error(
-                   "could not broadcast input array from shape " +
-                   ndarray_shape(x) + " into shape (" +
-                   std::to_string(i_slicelength) + ", " +
-                   std::to_string(j_slicelength) + ")");
-             }
+      // Asynchronous variants of "set", "take" and "get", returning a
+      // concurrent.futures.Future (see asyncio.wrap_future). The arrays
+      // must not be modified until the future is done.
+      .def(
+          "set_async",
+          [](const py::object& self, const Indices& i, const Indices& j,
+             const Values& x) {
+            check_array_ndim("i", 1, i, "j", 1, j, "x", 1, x);
+            check_ndarray_shape("i", i, "j", j, "x", x);
 
-             auto _x = x.unchecked<2>();
+            auto request = typename Requests::Request();
+            request.kind = Requests::kSet;
+            request.i = i;
+            request.j = j;
+            request.x = x;
+            return Requests::instance().submit(self, std::move(request));
+          },
+          py::arg("i"), py::arg("j"), py::arg("x"))
+      .def(
+          "take_async",
+          [](const py::object& self, const Indices& i, const Indices& j,
+             const T fill) {
+            check_ndarray_shape("i", i, "j", j);
 
-             for (size_t ix = 0; ix < i_slicelength; ++ix) {
-               auto start = j_start;
-               for (size_t jx = 0; jx < j_slicelength; ++jx) {
-                 self.set({i_start, start}, _x(ix, jx));
-                 start += j_step;
-               }
-               i_start += i_step;
-             }
+            auto request = typename Requests::Request();
+            request.kind = Requests::kTake;
+            request.i = i;
+            request.j = j;
+            request.fill = fill;
+            request.result = py::array_t<T>(
+                std::vector<py::ssize_t>(i.shape(), i.shape() + i.ndim()));
+            request.output = request.result.mutable_data();
+            return Requests::instance().submit(self, std::move(request));
+          },
+          py::arg("i"), py::arg("j"), py::arg("fill") = T(0))
+      // The slices are resolved against the shape of the matrix at the time
+      // of the call.
+      .def(
+          "get_async",
+          [](const py::object& self, const py::tuple& slices) {
+            auto request = typename Requests::Request();
+            request.kind = Requests::kGet;
+            std::tie(request.rows, request.cols) =
+                parse_slices(self.cast<const Matrix&>().shape(), slices);
+            return Requests::instance().submit(self, std::move(request));
+          },
+          py::arg("key"))
+      .def("set_block", &set_block<Matrix, T>, py::arg("key"), py::arg("x"),
+           py::arg("absent") = T(0), py::arg("erase") = true)
+      .def("__setitem__",
+           [](Matrix& self, const py::tuple& slices, py::array_t<T>& x) {
+             set_block(self, slices, x, T(0), true);
            })
       .def("__getitem__",
            [](const Matrix& self,
-              const py::tuple& slices) -> py::array_t<double> {
-             size_t i_start, i_stop, i_step, i_slicelength;
-             size_t j_start, j_stop, j_step, j_slicelength;
-             auto shape = self.shape();
-
-             std::tie(i_start, i_stop, i_step, i_slicelength, j_start, j_stop,
-                      j_step, j_slicelength) = parse_tuple(shape, slices);
-
-             auto x = py::array_t<double>({i_slicelength, j_slicelength});
-             auto _x = x.mutable_unchecked<2>();
-
-             for (size_t ix = 0; ix < i_slicelength; ++ix) {
-               auto start = j_start;
-               for (size_t jx = 0; jx < j_slicelength; ++jx) {
-                 _x(ix, jx) = self.get({i_start, start});
-                 start += j_step;
-               }
-               i_start += i_step;
+              const py::tuple& slices) -> py::array_t<T> {
+             Slice rows, cols;
+             std::tie(rows, cols) = parse_slices(self.shape(), slices);
+
+             if (rows.length != 0 && cols.length != 0) {
+               self.check_index({static_cast<I>(rows.start),
+                                 static_cast<I>(cols.start)});
              }
+
+             auto x = py::array_t<T>({rows.length, cols.length});
+             auto data = x.mutable_data();
+
+             py::gil_scoped_release release;
+             self.gather(rows, cols, data);
              return x;
            });
-}
\ No newline at end of file
+
+  bind_reduction<typename Matrix::Sum>(cls, "sum", &Matrix::sum);
+  bind_reduction<int64_t>(cls, "count_nonzero", &Matrix::count_nonzero);
+  bind_reduction<double>(cls, "mean", &Matrix::mean);
+  bind_reduction<T>(cls, "max", &Matrix::max);
+  bind_reduction<T>(cls, "min", &Matrix::min);
+  bind_partitioned<T, I>(m, partitioned);
+}
+
+PYBIND11_MODULE(core, m) {
+  auto types = py::dict();
+  bind_matrix<double, uint32_t>(m, "Matrix", "MatrixBuilder", "MatrixItems",
+                                "PartitionedMatrix", "MatrixExpression",
+                                types);
+  bind_matrix<float, uint32_t>(m, "MatrixF32", "MatrixF32Builder",
+                               "MatrixF32Items", "PartitionedMatrixF32",
+                               "MatrixF32Expression", types);
+  bind_matrix<int64_t, uint32_t>(m, "MatrixI64", "MatrixI64Builder",
+                                 "MatrixI64Items", "PartitionedMatrixI64",
+                                 "MatrixI64Expression", types);
+  bind_matrix<bool, uint32_t>(m, "MatrixBool", "MatrixBoolBuilder",
+                              "MatrixBoolItems", "PartitionedMatrixBool",
+                              "MatrixBoolExpression", types);
+  bind_matrix<double, uint64_t>(m, "MatrixU64", "MatrixU64Builder",
+                                "MatrixU64Items", "PartitionedMatrixU64",
+                                "MatrixU64Expression", types);
+
+  m.def(
+      "matrix",
+      [types](const py::object& dtype,
+              const py::object& index_dtype) -> py::object {
+        auto key = py::make_tuple(dtype_code(dtype), dtype_code(index_dtype));
+        if (!types.contains(key)) {
+          throw py::type_error("no matrix of values " +
+                               py::str(dtype).cast<std::string>() +
+                               " indexed by " +
+                               py::str(index_dtype).cast<std::string>());
+        }
+        return types[key]();
+      },
+      py::arg("dtype") = "float64", py::arg("index_dtype") = "uint32");
+  // Threads shared by the parallel kernels, the caller included. 0 restores
+  // the default: OMP_NUM_THREADS if set, otherwise the CPUs available.
+  m.def(
+      "set_num_threads",
+      [](const size_t n) { Scheduler::instance().set_threads(n); },
+      py::arg("n"), py::call_guard<py::gil_scoped_release>());
+  m.def("get_num_threads", []() { return Scheduler::instance().threads(); });
+  // Completes the asynchronous requests in flight before the interpreter
+  // is finalized.
+  py::module::import("atexit").attr("register")(py::cpp_function([]() {
+    py::gil_scoped_release release;
+    executor().stop();
+  }));
+
+  m.def(
+      "load",
+      [types](const std::string& path, const bool mmap,
+              const bool validate) -> py::object {
+        auto header = read_header(path);
+        auto key = py::make_tuple(std::string(header.value_type),
+                                  std::string(header.index_type));
+        if (!types.contains(key)) {
+          throw std::runtime_error(std::string("unsupported matrix type (") +
+                                   header.value_type + ", " +
+                                   header.index_type + ")");
+        }
+        return types[key].attr("load")(path, mmap, validate);
+      },
+      py::arg("path"), py::arg("mmap") = true, py::arg("validate") = false);
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include "scheduler.hpp"
+
+// Number of threads used by the parallel kernels (see "Scheduler").
+inline auto concurrency() -> size_t { return Scheduler::instance().threads(); }
+
+// Number of threads worth using to process "size" items, each thread handling
+// at least "grain" items.
+inline auto num_threads(const size_t size, const size_t grain) -> size_t {
+  return std::max(std::min(concurrency(), size / std::max(grain, size_t(1))),
+                  size_t(1));
+}
+
+// Splits [0, size) into "threads" contiguous ranges and calls
+// "f(index, first, last)" for each of them on the threads of the scheduler,
+// "index" being the rank of the range. An exception thrown by a range is
+// rethrown to the caller. The counters of the workers (see "local_stats")
+// are added to the counters of the caller.
+template <typename F>
+auto parallel_for(const size_t size, const size_t threads, const F& f)
+    -> void {
+  if (threads <= 1 || size <= 1) {
+    f(0, 0, size);
+    return;
+  }
+  auto chunk = size / threads;
+  auto remainder = size % threads;
+  Scheduler::instance().run(threads, [&](const size_t ix) {
+    auto first = ix * chunk + std::min(ix, remainder);
+    auto last = first + chunk + (ix < remainder ? 1 : 0);
+    f(ix, first, last);
+  });
+}
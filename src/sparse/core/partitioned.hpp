@@ -0,0 +1,354 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "parallel.hpp"
+#include "serialization.hpp"
+#include "sparse.hpp"
+
+// Matrix split into shards holding consecutive ranges of rows: the shard "s"
+// holds the rows [bounds[s], bounds[s + 1]), indexed from 0 (its row i being
+// the row bounds[s] + i of the matrix), so that each shard is a regular
+// matrix, mutable or frozen. The batched methods route each entry to the
+// shard owning its row, then make one call per shard. The methods accessing
+// the entries can be called concurrently, the shards being locked by their
+// own methods.
+//
+// Saved matrices store each shard in its own file, in the format of
+// "Matrix::save": a process can load the whole matrix or a single shard, and
+// the shards mapped from a shared memory file system (e.g. /dev/shm) are
+// shared by the processes without being copied.
+template <typename T = double, typename I = uint32_t>
+class Partitioned {
+ public:
+  using Matrix = ::Matrix<T, I>;
+  using Key = typename Matrix::Key;
+
+  // Empty shards bounded by "bounds", an increasing sequence starting at 0
+  // whose last item is the number of rows of the matrix.
+  explicit Partitioned(std::vector<uint64_t> bounds)
+      : Partitioned(bounds, std::vector<Matrix>(
+                                bounds.empty() ? 0 : bounds.size() - 1)) {}
+
+  Partitioned(std::vector<uint64_t> bounds, std::vector<Matrix> shards)
+      : bounds_(std::move(bounds)), shards_(std::move(shards)) {
+    if (bounds_.size() < 2 || bounds_[0] != 0 ||
+        !std::is_sorted(bounds_.begin(), bounds_.end()) ||
+        bounds_.back() > std::numeric_limits<I>::max()) {
+      throw std::invalid_argument(
+          "bounds must be an increasing sequence of at least two row "
+          "indices starting at 0");
+    }
+    if (shards_.size() != bounds_.size() - 1) {
+      throw std::invalid_argument("expected " +
+                                  std::to_string(bounds_.size() - 1) +
+                                  " shards, got " +
+                                  std::to_string(shards_.size()));
+    }
+    for (size_t sx = 0; sx < shards_.size(); ++sx) {
+      auto rows = std::get<0>(shards_[sx].shape());
+      if (rows > bounds_[sx + 1] - bounds_[sx]) {
+        throw std::invalid_argument(
+            "shard " + std::to_string(sx) + " has " + std::to_string(rows) +
+            " rows, more than its range of " +
+            std::to_string(bounds_[sx + 1] - bounds_[sx]));
+      }
+    }
+  }
+
+  // Matrix of "rows" rows split into "shards" ranges of equal sizes.
+  static auto split(const uint64_t rows, const size_t shards) -> Partitioned {
+    if (shards == 0) {
+      throw std::invalid_argument("the number of shards must be positive");
+    }
+    auto bounds = std::vector<uint64_t>(shards + 1);
+    for (size_t sx = 0; sx <= shards; ++sx) {
+      bounds[sx] = rows / shards * sx + std::min<uint64_t>(rows % shards, sx);
+    }
+    return Partitioned(std::move(bounds));
+  }
+
+  auto bounds() const -> const std::vector<uint64_t>& { return bounds_; }
+  auto size() const -> size_t { return shards_.size(); }
+  auto shard(const size_t sx) -> Matrix& { return shards_.at(sx); }
+  auto shard(const size_t sx) const -> const Matrix& { return shards_.at(sx); }
+
+  // Index of the shard owning the row "i".
+  auto owner(const uint64_t i) const -> size_t {
+    if (i >= bounds_.back()) {
+      throw pybind11::index_error("index " + std::to_string(i) +
+                                  " is out of bounds for axis 0 with size " +
+                                  std::to_string(bounds_.back()));
+    }
+    return static_cast<size_t>(
+        std::upper_bound(bounds_.begin(), bounds_.end(), i) -
+        bounds_.begin() - 1);
+  }
+
+  // Shape of the matrix: the shards are bounded by the largest indices
+  // stored (see "Matrix::shape"), the ranges of the rows being fixed. The
+  // number of rows fits in "I", the last bound being checked by the
+  // constructor.
+  auto shape() const -> Key {
+    auto rows = uint64_t(0);
+    auto cols = uint64_t(0);
+    for (size_t sx = 0; sx < shards_.size(); ++sx) {
+      auto shape = shards_[sx].shape();
+      if (std::get<0>(shape) != 0) {
+        rows = bounds_[sx] + std::get<0>(shape);
+        cols = std::max<uint64_t>(cols, std::get<1>(shape));
+      }
+    }
+    return {static_cast<I>(rows), static_cast<I>(cols)};
+  }
+
+  auto nnz() const -> size_t {
+    auto result = size_t(0);
+    for (auto& item : shards_) {
+      result += item.nnz();
+    }
+    return result;
+  }
+
+  auto nbytes() const -> size_t {
+    auto result = sizeof(*this) + bounds_.size() * sizeof(uint64_t);
+    for (auto& item : shards_) {
+      result += item.nbytes();
+    }
+    return result;
+  }
+
+  auto set(const Key& key, const T x) -> void {
+    auto sx = owner(std::get<0>(key));
+    shards_[sx].set(local(sx, key), x);
+  }
+
+  // Same as "Matrix::get", the bounds being those of the whole matrix: the
+  // shard owning the row may be bounded by fewer rows and columns.
+  auto get(const Key& key) const -> T {
+    auto value = T(0);
+    if (!get(key, value)) {
+      check_bounds(key);
+    }
+    return value;
+  }
+
+  auto get(const Key& key, T& value) const -> bool {
+    auto sx = owner(std::get<0>(key));
+    return shards_[sx].get(local(sx, key), value);
+  }
+
+  // Same as "Matrix::set", "Matrix::add" and "Matrix::erase".
+  auto set(const I* i, const I* j, const T* x, const size_t n) -> void {
+    route(i, j, x, n, [&](const size_t sx, const Batch& batch) {
+      shards_[sx].set(batch.i.data(), batch.j.data(), batch.values(),
+                      batch.size());
+    });
+  }
+
+  auto add(const I* i, const I* j, const T* x, const size_t n) -> void {
+    route(i, j, x, n, [&](const size_t sx, const Batch& batch) {
+      shards_[sx].add(batch.i.data(), batch.j.data(), batch.values(),
+                      batch.size());
+    });
+  }
+
+  auto erase(const I* i, const I* j, const size_t n) -> void {
+    route(i, j, static_cast<const T*>(nullptr), n,
+          [&](const size_t sx, const Batch& batch) {
+            shards_[sx].erase(batch.i.data(), batch.j.data(), batch.size());
+          });
+  }
+
+  // Same as "Matrix::take": the lookups of each shard are made by a single
+  // call, their results being scattered back to "x".
+  auto take(const I* i, const I* j, const size_t n, const T fill, T* x) const
+      -> void {
+    auto lookups = std::vector<Storage<T>>();
+    route(i, j, static_cast<const T*>(nullptr), n,
+          [&](const size_t sx, const Batch& batch) {
+            auto size = batch.size();
+            lookups.resize(size);
+            shards_[sx].take(batch.i.data(), batch.j.data(), size, fill,
+                             reinterpret_cast<T*>(lookups.data()));
+            parallel_for(size, num_threads(size, kScatterGrain),
+                         [&](const size_t, const size_t first,
+                             const size_t last) {
+                           for (auto ix = first; ix < last; ++ix) {
+                             x[batch.order[ix]] = lookups[ix];
+                           }
+                         });
+          });
+  }
+
+  // Same as "Matrix::dot": each shard computes the rows of "y" it owns.
+  auto dot(const double* x, const size_t cols, const size_t k, double* y,
+           const size_t rows) const -> void {
+    for (size_t sx = 0; sx < shards_.size() && bounds_[sx] < rows; ++sx) {
+      auto size = std::min<uint64_t>(bounds_[sx + 1], rows) - bounds_[sx];
+      shards_[sx].dot(x, cols, k, y + bounds_[sx] * k,
+                      static_cast<size_t>(size));
+    }
+  }
+
+  auto freeze(const bool csc = false) -> void {
+    for (auto& item : shards_) {
+      item.freeze(csc);
+    }
+  }
+
+  auto tile() -> void {
+    for (auto& item : shards_) {
+      item.tile();
+    }
+  }
+
+  auto thaw() -> void {
+    for (auto& item : shards_) {
+      item.thaw();
+    }
+  }
+
+  // Path of the file storing the shard "sx" of a matrix saved to "path".
+  static auto shard_path(const std::string& path, const size_t sx)
+      -> std::string {
+    return path + "." + std::to_string(sx);
+  }
+
+  // Writes the bounds of the shards to "path", and the shard "s" to
+  // "shard_path(path, s)".
+  auto save(const std::string& path) const -> void {
+    for (size_t sx = 0; sx < shards_.size(); ++sx) {
+      shards_[sx].save(shard_path(path, sx));
+    }
+    auto stream = std::ofstream(path, std::ios::binary | std::ios::trunc);
+    if (!stream) {
+      throw std::runtime_error("unable to create " + path);
+    }
+    write_partition(stream, bounds_);
+  }
+
+  // Loads a matrix written by "save", the shards being mapped in memory if
+  // "mmap" is true and their indices checked if "validate" is true (see
+  // "Matrix::load").
+  static auto load(const std::string& path, const bool mmap = true,
+                   const bool validate = false) -> Partitioned {
+    auto file = open_file(path, false);
+    auto bounds = read_partition(file.data, file.size);
+    auto shards = std::vector<Matrix>();
+    shards.reserve(bounds.size() - 1);
+    for (size_t sx = 0; sx + 1 < bounds.size(); ++sx) {
+      shards.push_back(
+          Matrix::load(shard_path(path, sx), mmap, validate));
+    }
+    return Partitioned(std::move(bounds), std::move(shards));
+  }
+
+ private:
+  // Entries routed to a shard: their local indices, their values, and their
+  // positions in the arrays of the caller.
+  struct Batch {
+    std::vector<I> i;
+    std::vector<I> j;
+    std::vector<Storage<T>> x;
+    std::vector<size_t> order;
+
+    auto size() const -> size_t { return i.size(); }
+    auto values() const -> const T* {
+      return reinterpret_cast<const T*>(x.data());
+    }
+  };
+
+  // Minimum number of entries processed by a thread.
+  static constexpr size_t kScatterGrain = 1 << 14;
+
+  // Throws an IndexError if the index is out of the bounds of the matrix.
+  auto check_bounds(const Key& key) const -> void {
+    auto shape = this->shape();
+    auto i = std::get<0>(key);
+    if (i >= std::get<0>(shape)) {
+      throw pybind11::index_error("index " + std::to_string(i) +
+                                  " is out of bounds for axis 0 with size " +
+                                  std::to_string(std::get<0>(shape)));
+    }
+    auto j = std::get<1>(key);
+    if (j >= std::get<1>(shape)) {
+      throw pybind11::index_error("index " + std::to_string(j) +
+                                  " is out of bounds for axis 1 with size " +
+                                  std::to_string(std::get<1>(shape)));
+    }
+  }
+
+  auto local(const size_t sx, const Key& key) const -> Key {
+    return {static_cast<I>(std::get<0>(key) - bounds_[sx]), std::get<1>(key)};
+  }
+
+  // Groups the "n" entries (i[k], j[k], x[k]) by shard, keeping their order,
+  // and calls "f(sx, batch)" for each shard "sx" owning some of them. The
+  // values are ignored if "x" is null.
+  template <typename F>
+  auto route(const I* i, const I* j, const T* x, const size_t n,
+             const F& f) const -> void {
+    auto owners = std::vector<uint32_t>(n);
+    auto shards = shards_.size();
+    auto threads = num_threads(n, kScatterGrain);
+    auto counts = std::vector<std::vector<size_t>>(threads);
+    parallel_for(n, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto& count = counts[rank];
+                   count.assign(shards, 0);
+                   for (auto ix = first; ix < last; ++ix) {
+                     owners[ix] = static_cast<uint32_t>(owner(i[ix]));
+                     ++count[owners[ix]];
+                   }
+                 });
+
+    auto batches = std::vector<Batch>(shards);
+    for (size_t sx = 0; sx < shards; ++sx) {
+      // Position of the first entry of each thread in the batch.
+      auto size = size_t(0);
+      for (auto& count : counts) {
+        auto items = count[sx];
+        count[sx] = size;
+        size += items;
+      }
+      auto& batch = batches[sx];
+      batch.i.resize(size);
+      batch.j.resize(size);
+      batch.x.resize(x != nullptr ? size : 0);
+      batch.order.resize(size);
+    }
+    parallel_for(n, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto& offset = counts[rank];
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto sx = owners[ix];
+                     auto& batch = batches[sx];
+                     auto kx = offset[sx]++;
+                     batch.i[kx] = static_cast<I>(i[ix] - bounds_[sx]);
+                     batch.j[kx] = j[ix];
+                     if (x != nullptr) {
+                       batch.x[kx] = x[ix];
+                     }
+                     batch.order[kx] = ix;
+                   }
+                 });
+
+    for (size_t sx = 0; sx < shards; ++sx) {
+      if (!batches[sx].i.empty()) {
+        f(sx, batches[sx]);
+        batches[sx] = Batch();
+      }
+    }
+  }
+
+  std::vector<uint64_t> bounds_;
+  std::vector<Matrix> shards_;
+};
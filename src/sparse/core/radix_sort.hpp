@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "parallel.hpp"
+#include "types.hpp"
+
+// Digits of the radix sort: 11 bits, the counts of a thread (16 KiB) staying
+// in cache.
+inline constexpr size_t kRadixBits = 11;
+inline constexpr size_t kRadix = size_t(1) << kRadixBits;
+
+// Digit "pass" (0 being the least significant) of a key.
+inline auto key_digit(const uint64_t key, const size_t pass) -> size_t {
+  auto shift = kRadixBits * pass;
+  return shift < 64 ? (key >> shift) & (kRadix - 1) : 0;
+}
+
+inline auto key_digit(const Key128& key, const size_t pass) -> size_t {
+  auto shift = kRadixBits * pass;
+  if (shift >= 64) {
+    return (key.high >> (shift - 64)) & (kRadix - 1);
+  }
+  auto bits = key.low >> shift;
+  if (shift + kRadixBits > 64) {
+    bits |= key.high << (64 - shift);
+  }
+  return bits & (kRadix - 1);
+}
+
+// Sorts "items" in ascending order of their member "key", a uint64_t or a
+// Key128, by a parallel least significant digit radix sort: each pass counts
+// the digits of the ranges of the threads, then moves the items concurrently
+// to their positions. The passes on a digit shared by all the keys (e.g. the
+// high bits of small indices) are skipped. The order of items with equal
+// keys is preserved.
+template <typename Item>
+auto radix_sort(std::vector<Item>& items) -> void {
+  using Key = decltype(Item::key);
+  using Counts = std::array<size_t, kRadix>;
+  static constexpr size_t kPasses =
+      (8 * sizeof(Key) + kRadixBits - 1) / kRadixBits;
+  // Below this size, std::stable_sort is faster than the passes.
+  static constexpr size_t kMinSize = 1 << 12;
+  static constexpr size_t kGrain = 1 << 15;
+
+  auto size = items.size();
+  if (size < kMinSize) {
+    std::stable_sort(items.begin(), items.end(),
+                     [](const Item& lhs, const Item& rhs) {
+                       return lhs.key < rhs.key;
+                     });
+    return;
+  }
+  auto threads = num_threads(size, kGrain);
+
+  // Counts of the digits of each pass, for the range of each thread. The
+  // counts of the whole array do not depend on the order of the items: they
+  // tell the passes on a digit shared by all the keys. The counts of the
+  // ranges are only valid for the first pass sorting the items.
+  auto counts = std::vector<std::array<Counts, kPasses>>(threads);
+  parallel_for(size, threads,
+               [&](const size_t rank, const size_t first, const size_t last) {
+                 auto& count = counts[rank];
+                 for (auto& item : count) {
+                   item.fill(0);
+                 }
+                 for (auto ix = first; ix < last; ++ix) {
+                   for (size_t pass = 0; pass < kPasses; ++pass) {
+                     ++count[pass][key_digit(items[ix].key, pass)];
+                   }
+                 }
+               });
+  auto skip = std::array<bool, kPasses>();
+  for (size_t pass = 0; pass < kPasses; ++pass) {
+    auto head = key_digit(items[0].key, pass);
+    auto total = size_t(0);
+    for (auto& count : counts) {
+      total += count[pass][head];
+    }
+    skip[pass] = total == size;
+  }
+
+  auto buffer = std::vector<Item>(size);
+  auto sorted = false;
+  for (size_t pass = 0; pass < kPasses; ++pass) {
+    if (skip[pass]) {
+      continue;
+    }
+    if (sorted && threads > 1) {
+      parallel_for(size, threads,
+                   [&](const size_t rank, const size_t first,
+                       const size_t last) {
+                     auto& count = counts[rank][pass];
+                     count.fill(0);
+                     for (auto ix = first; ix < last; ++ix) {
+                       ++count[key_digit(items[ix].key, pass)];
+                     }
+                   });
+    }
+    sorted = true;
+    // Position of the first item of each digit of each thread, the items of
+    // a digit being ordered by thread.
+    auto offset = size_t(0);
+    for (size_t digit = 0; digit < kRadix; ++digit) {
+      for (auto& count : counts) {
+        auto n = count[pass][digit];
+        count[pass][digit] = offset;
+        offset += n;
+      }
+    }
+    parallel_for(size, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto& position = counts[rank][pass];
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto& item = items[ix];
+                     buffer[position[key_digit(item.key, pass)]++] = item;
+                   }
+                 });
+    items.swap(buffer);
+  }
+}
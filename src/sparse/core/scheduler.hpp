@@ -0,0 +1,427 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "stats.hpp"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Pool of threads shared by the parallel kernels of the module. A job of
+// "count" tasks is queued on the workers, which pop the jobs of their own
+// queue and steal the jobs of the other queues when theirs is empty; the
+// caller runs tasks of its job as well. A task starting a nested job runs it
+// on the same pool.
+//
+// The number of threads, the caller included, defaults to OMP_NUM_THREADS if
+// set, and otherwise to the CPUs available to the process (its affinity mask
+// and its cgroup CPU quota). On machines with several NUMA nodes, each
+// worker is pinned to the CPUs of one node, the workers filling the nodes
+// one after the other.
+class Scheduler {
+ public:
+  static auto instance() -> Scheduler& {
+    // Never destroyed: the workers may still be waiting at exit.
+    static auto* result = new Scheduler();
+    return *result;
+  }
+
+  Scheduler(const Scheduler&) = delete;
+  auto operator=(const Scheduler&) -> Scheduler& = delete;
+
+  auto threads() const -> size_t { return threads_.load(); }
+
+  // Sets the number of threads, 0 restoring the default. Waits for the jobs
+  // running to complete.
+  auto set_threads(const size_t threads) -> void {
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    resizing_ = true;
+    idle_.wait(lock, [&]() { return active_ == 0; });
+    stop_workers();
+    threads_ = threads == 0 ? default_threads() : threads;
+    resizing_ = false;
+    idle_.notify_all();
+  }
+
+  // Calls "f(ix)" for each ix in [0, count), on the caller and the workers.
+  // The first exception thrown is rethrown once all the tasks completed.
+  // The counters (see "local_stats") of the workers are added to the
+  // counters of the caller.
+  template <typename F>
+  auto run(const size_t count, const F& f) -> void {
+    if (count == 0) {
+      return;
+    }
+    auto active = Active(*this, depth() == 0);
+    auto job = std::make_shared<Job>();
+    job->task = [&f](const size_t ix) { f(ix); };
+    job->count = count;
+    job->pending = count;
+    try {
+      push(job, std::min(count - 1, queues_.size()));
+    } catch (const std::bad_alloc&) {
+      // The tasks not queued are run by the caller.
+    }
+
+    ++depth();
+    job->work(true);
+    --depth();
+    {
+      auto lock = std::unique_lock<std::mutex>(job->mutex);
+      job->done.wait(lock, [&]() { return job->pending == 0; });
+    }
+    if constexpr (kStats) {
+      local_stats() += job->stats;
+    }
+    if (job->exception) {
+      std::rethrow_exception(job->exception);
+    }
+  }
+
+ private:
+  struct Job {
+    std::function<void(size_t)> task;
+    size_t count{0};
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> pending{0};
+    // Counters of the workers.
+    Stats stats;
+    std::exception_ptr exception;
+    std::mutex mutex;
+    std::condition_variable done;
+
+    // Runs the tasks of the job not yet claimed by another thread.
+    auto work(const bool is_caller) -> void {
+      for (auto ix = next++; ix < count; ix = next++) {
+        [[maybe_unused]] auto before = Stats();
+        if constexpr (kStats) {
+          before = local_stats();
+        }
+        try {
+          task(ix);
+        } catch (...) {
+          auto lock = std::lock_guard<std::mutex>(mutex);
+          if (!exception) {
+            exception = std::current_exception();
+          }
+        }
+        auto lock = std::unique_lock<std::mutex>(mutex);
+        if constexpr (kStats) {
+          if (!is_caller) {
+            stats += local_stats() - before;
+          }
+        }
+        if (--pending == 0) {
+          done.notify_all();
+        }
+      }
+    }
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Job>> jobs;
+  };
+
+  // Registers a job started by a thread outside the pool, the pool being
+  // neither resized nor stopped until it completes.
+  class Active {
+   public:
+    Active(Scheduler& scheduler, const bool outer)
+        : scheduler_(scheduler), outer_(outer) {
+      if (outer_) {
+        auto lock = std::unique_lock<std::mutex>(scheduler_.mutex_);
+        scheduler_.idle_.wait(lock, [&]() { return !scheduler_.resizing_; });
+        ++scheduler_.active_;
+        if (scheduler_.queues_.empty() && scheduler_.threads_ > 1) {
+          scheduler_.start_workers();
+        }
+      }
+    }
+
+    ~Active() {
+      if (outer_) {
+        auto lock = std::unique_lock<std::mutex>(scheduler_.mutex_);
+        if (--scheduler_.active_ == 0) {
+          scheduler_.idle_.notify_all();
+        }
+      }
+    }
+
+   private:
+    Scheduler& scheduler_;
+    bool outer_;
+  };
+
+  Scheduler() : threads_(default_threads()) {}
+
+  // Number of jobs being run or tasks of a job being run by the calling
+  // thread.
+  static auto depth() -> size_t& {
+    thread_local size_t depth = 0;
+    return depth;
+  }
+
+  // Index of the queue of the calling thread, or -1 if it is not a worker.
+  static auto worker_index() -> ptrdiff_t& {
+    thread_local ptrdiff_t index = -1;
+    return index;
+  }
+
+  // Queues "copies" references to a job, one per queue starting with the
+  // queue of the calling thread (or the next one in turn).
+  auto push(const std::shared_ptr<Job>& job, const size_t copies) -> void {
+    if (copies == 0) {
+      return;
+    }
+    auto first = worker_index() >= 0 ? static_cast<size_t>(worker_index())
+                                     : cursor_++ % queues_.size();
+    for (size_t ix = 0; ix < copies; ++ix) {
+      auto& queue = *queues_[(first + ix) % queues_.size()];
+      auto lock = std::lock_guard<std::mutex>(queue.mutex);
+      queue.jobs.push_back(job);
+    }
+    {
+      auto lock = std::lock_guard<std::mutex>(sleep_mutex_);
+      ++signal_;
+    }
+    if (copies == 1) {
+      wake_.notify_one();
+    } else {
+      wake_.notify_all();
+    }
+  }
+
+  // Pops the newest job of the queue "index", or steals the oldest job of
+  // another queue.
+  auto pop(const size_t index) -> std::shared_ptr<Job> {
+    auto result = std::shared_ptr<Job>();
+    {
+      auto& queue = *queues_[index];
+      auto lock = std::lock_guard<std::mutex>(queue.mutex);
+      if (!queue.jobs.empty()) {
+        result = std::move(queue.jobs.back());
+        queue.jobs.pop_back();
+        return result;
+      }
+    }
+    for (size_t ix = 1; ix < queues_.size(); ++ix) {
+      auto& queue = *queues_[(index + ix) % queues_.size()];
+      auto lock = std::lock_guard<std::mutex>(queue.mutex);
+      if (!queue.jobs.empty()) {
+        result = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+        return result;
+      }
+    }
+    return result;
+  }
+
+  auto run_worker(const size_t index) -> void {
+    worker_index() = static_cast<ptrdiff_t>(index);
+    while (true) {
+      auto signal = uint64_t(0);
+      {
+        auto lock = std::lock_guard<std::mutex>(sleep_mutex_);
+        signal = signal_;
+      }
+      for (auto job = pop(index); job; job = pop(index)) {
+        ++depth();
+        job->work(false);
+        --depth();
+      }
+      auto lock = std::unique_lock<std::mutex>(sleep_mutex_);
+      wake_.wait(lock, [&]() { return signal_ != signal || stopping_; });
+      if (stopping_) {
+        return;
+      }
+    }
+  }
+
+  // Starts threads_ - 1 workers. Called with mutex_ held and no job running.
+  auto start_workers() -> void {
+    auto workers = threads_ - 1;
+    for (size_t ix = 0; ix < workers; ++ix) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    auto nodes = numa_cpus();
+    for (size_t ix = 0; ix < workers; ++ix) {
+      workers_.emplace_back([this, ix]() { run_worker(ix); });
+      if (nodes.size() > 1) {
+        pin(workers_.back(), nodes, ix + 1);
+      }
+    }
+  }
+
+  // Stops the workers. Called with mutex_ held and no job running.
+  auto stop_workers() -> void {
+    {
+      auto lock = std::lock_guard<std::mutex>(sleep_mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& item : workers_) {
+      item.join();
+    }
+    workers_.clear();
+    queues_.clear();
+    stopping_ = false;
+  }
+
+  // CPUs available to the process.
+  static auto available_cpus() -> std::vector<int> {
+    auto result = std::vector<int>();
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          result.push_back(cpu);
+        }
+      }
+    }
+#endif
+    return result;
+  }
+
+  // Available CPUs of each NUMA node having some.
+  static auto numa_cpus() -> std::vector<std::vector<int>> {
+    auto result = std::vector<std::vector<int>>();
+#ifdef __linux__
+    auto available = available_cpus();
+    for (int node = 0;; ++node) {
+      auto file = std::ifstream("/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist");
+      if (!file) {
+        break;
+      }
+      // Comma-separated ranges, such as "0-15,32-47".
+      auto cpus = std::vector<int>();
+      auto range = std::string();
+      while (std::getline(file, range, ',')) {
+        auto first = 0;
+        auto last = 0;
+        auto dash = range.find('-');
+        first = std::atoi(range.c_str());
+        last = dash == std::string::npos
+                   ? first
+                   : std::atoi(range.c_str() + dash + 1);
+        for (auto cpu = first; cpu <= last; ++cpu) {
+          if (std::binary_search(available.begin(), available.end(), cpu)) {
+            cpus.push_back(cpu);
+          }
+        }
+      }
+      if (!cpus.empty()) {
+        result.push_back(std::move(cpus));
+      }
+    }
+#endif
+    return result;
+  }
+
+  // Pins the thread of rank "rank" to the CPUs of its node.
+  static auto pin(std::thread& thread,
+                  const std::vector<std::vector<int>>& nodes,
+                  const size_t rank) -> void {
+#ifdef __linux__
+    auto cpus = size_t(0);
+    for (auto& item : nodes) {
+      cpus += item.size();
+    }
+    auto slot = rank % cpus;
+    auto node = size_t(0);
+    while (slot >= nodes[node].size()) {
+      slot -= nodes[node].size();
+      ++node;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : nodes[node]) {
+      CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    static_cast<void>(thread);
+    static_cast<void>(nodes);
+    static_cast<void>(rank);
+#endif
+  }
+
+  // CPUs allowed by the cgroup CPU quota (v2 or v1), or 0 if unlimited.
+  static auto cgroup_cpus() -> size_t {
+    auto quota = 0.0;
+    auto period = 0.0;
+    auto file = std::ifstream("/sys/fs/cgroup/cpu.max");
+    auto text = std::string();
+    if (file >> text >> period) {
+      if (text == "max") {
+        return 0;
+      }
+      quota = std::atof(text.c_str());
+    } else {
+      auto quota_file = std::ifstream("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+      auto period_file =
+          std::ifstream("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+      if (!(quota_file >> quota) || !(period_file >> period)) {
+        return 0;
+      }
+    }
+    if (quota <= 0 || period <= 0) {
+      return 0;
+    }
+    return std::max(static_cast<size_t>(quota / period + 0.5), size_t(1));
+  }
+
+  static auto default_threads() -> size_t {
+    // A list of values for the nested levels, the first one applying here.
+    if (auto* value = std::getenv("OMP_NUM_THREADS")) {
+      auto threads = std::atoi(value);
+      if (threads > 0) {
+        return static_cast<size_t>(threads);
+      }
+    }
+    auto result = static_cast<size_t>(std::thread::hardware_concurrency());
+    auto available = available_cpus().size();
+    if (available != 0) {
+      result = available;
+    }
+    auto quota = cgroup_cpus();
+    if (quota != 0) {
+      result = std::min(result, quota);
+    }
+    return std::max(result, size_t(1));
+  }
+
+  std::atomic<size_t> threads_;
+  // Jobs started by threads outside the pool, and whether the pool is being
+  // resized, waiting for them to complete.
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  size_t active_{0};
+  bool resizing_{false};
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> cursor_{0};
+  // Incremented when jobs are queued, waking the idle workers.
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  uint64_t signal_{0};
+  bool stopping_{false};
+};
@@ -0,0 +1,374 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "compressed.hpp"
+#include "types.hpp"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// State of a matrix stored on disk: its compressed storage, the bounds of
+// its indices and its transposition flag.
+template <typename T, typename I>
+struct Snapshot {
+  std::shared_ptr<const Compressed<T, I>> compressed;
+  I i{0};
+  I j{0};
+  bool transposed{false};
+};
+
+// Binary format of a snapshot (native byte order):
+//   - a header of 64 bytes;
+//   - indptr: (major + 1) uint64;
+//   - majors: major unsigned integers, padded to a multiple of 8 bytes, only
+//     if the storage is hypersparse;
+//   - indices: nnz unsigned integers, padded to a multiple of 8 bytes;
+//   - data: nnz values, omitted for a boolean matrix.
+// Each array starts on an 8-byte boundary, so that the arrays of a memory
+// mapped file can be used in place. The types of the values and indices are
+// recorded by their NumPy codes ("f8", "u4", ...).
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t axis;
+  uint32_t transposed;
+  uint32_t hypersparse;
+  char value_type[4];
+  char index_type[4];
+  uint64_t i;
+  uint64_t j;
+  uint64_t major;
+  uint64_t nnz;
+
+  static constexpr char kMagic[4] = {'S', 'P', 'M', 'X'};
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kByteOrder = 0x01020304;
+
+  // Size in bytes of a type from its code.
+  static auto type_size(const char* code) -> size_t {
+    return static_cast<size_t>(code[1] - '0');
+  }
+
+  // Offsets of the arrays and size of the file.
+  auto indptr_offset() const -> size_t { return sizeof(Header); }
+  auto majors_offset() const -> size_t {
+    return indptr_offset() + (major + 1) * sizeof(uint64_t);
+  }
+  auto indices_offset() const -> size_t {
+    auto size = hypersparse ? major * type_size(index_type) : 0;
+    return majors_offset() + (size + 7) / 8 * 8;
+  }
+  auto data_offset() const -> size_t {
+    return indices_offset() + (nnz * type_size(index_type) + 7) / 8 * 8;
+  }
+  auto file_size() const -> size_t {
+    auto value_size = value_type[0] == 'b' ? 0 : type_size(value_type);
+    return data_offset() + nnz * value_size;
+  }
+
+  // Reads the header of a file of "size" bytes, checking its format.
+  static auto read(const char* buffer, const size_t size) -> Header {
+    auto header = Header{};
+    if (size < sizeof(Header)) {
+      throw std::runtime_error("invalid matrix: truncated header");
+    }
+    std::memcpy(&header, buffer, sizeof(Header));
+    if (std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0) {
+      throw std::runtime_error("invalid matrix: bad magic number");
+    }
+    if (header.version != kVersion) {
+      throw std::runtime_error("unsupported matrix format version " +
+                               std::to_string(header.version));
+    }
+    if (header.byte_order != kByteOrder) {
+      throw std::runtime_error("invalid matrix: unsupported byte order");
+    }
+    if (header.value_type[3] != 0 || header.index_type[3] != 0) {
+      throw std::runtime_error("invalid matrix: corrupted header");
+    }
+    return header;
+  }
+};
+
+static_assert(sizeof(Header) == 64, "unexpected size of the header");
+
+// Writes a snapshot to a stream.
+template <typename T, typename I>
+auto write_snapshot(std::ostream& stream, const Snapshot<T, I>& snapshot)
+    -> void {
+  auto& compressed = *snapshot.compressed;
+  auto header = Header{};
+  std::memcpy(header.magic, Header::kMagic, sizeof(header.magic));
+  header.version = Header::kVersion;
+  header.byte_order = Header::kByteOrder;
+  header.axis = static_cast<uint32_t>(compressed.axis);
+  header.transposed = snapshot.transposed ? 1 : 0;
+  header.hypersparse = compressed.hypersparse() ? 1 : 0;
+  type_code<T>().copy(header.value_type, sizeof(header.value_type) - 1);
+  type_code<I>().copy(header.index_type, sizeof(header.index_type) - 1);
+  header.i = snapshot.i;
+  header.j = snapshot.j;
+  header.major = compressed.major();
+  header.nnz = compressed.size();
+
+  // Writes an array of indices starting at the offset "first", padded up to
+  // the offset "last" of the next array.
+  auto write_indices = [&](const Array<I>& array, const size_t first,
+                           const size_t last) {
+    auto padding = uint64_t(0);
+    auto size = array.size() * sizeof(I);
+    stream.write(reinterpret_cast<const char*>(array.data()), size);
+    stream.write(reinterpret_cast<const char*>(&padding), last - first - size);
+  };
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  stream.write(reinterpret_cast<const char*>(compressed.indptr.data()),
+               compressed.indptr.size() * sizeof(uint64_t));
+  write_indices(compressed.majors, header.majors_offset(),
+                header.indices_offset());
+  write_indices(compressed.indices, header.indices_offset(),
+                header.data_offset());
+  stream.write(reinterpret_cast<const char*>(compressed.data.data()),
+               compressed.data.size() * sizeof(T));
+  if (!stream) {
+    throw std::runtime_error("unable to write the matrix");
+  }
+}
+
+// Reads a snapshot from "size" bytes starting at "buffer", aligned on 8
+// bytes. The arrays of the snapshot point into the buffer, kept alive by
+// "owner". The header and the offsets are checked; the indices are only
+// checked if "validate" is true, the check reading all of them.
+template <typename T, typename I>
+auto read_snapshot(const char* buffer, const size_t size,
+                   std::shared_ptr<const void> owner,
+                   const bool validate = false) -> Snapshot<T, I> {
+  auto header = Header::read(buffer, size);
+  if (header.value_type != type_code<T>() ||
+      header.index_type != type_code<I>()) {
+    throw std::runtime_error(
+        std::string("matrix of type (") + header.value_type + ", " +
+        header.index_type + ") cannot be loaded as (" + type_code<T>() +
+        ", " + type_code<I>() + ")");
+  }
+  if (header.axis > 1 || header.hypersparse > 1 || header.major >= size ||
+      header.nnz >= size || size < header.file_size()) {
+    throw std::runtime_error("invalid matrix: truncated or corrupted data");
+  }
+  // The shape of the matrix, one past its bounds, must fit in "I".
+  if (header.i >= std::numeric_limits<I>::max() ||
+      header.j >= std::numeric_limits<I>::max()) {
+    throw std::runtime_error("invalid matrix: corrupted bounds");
+  }
+
+  auto compressed = std::make_shared<Compressed<T, I>>();
+  compressed->axis = static_cast<int>(header.axis);
+  compressed->indptr = Array<uint64_t>(
+      reinterpret_cast<const uint64_t*>(buffer + header.indptr_offset()),
+      header.major + 1, owner);
+  if (header.hypersparse) {
+    compressed->majors = Array<I>(
+        reinterpret_cast<const I*>(buffer + header.majors_offset()),
+        header.major, owner);
+  }
+  compressed->indices = Array<I>(
+      reinterpret_cast<const I*>(buffer + header.indices_offset()),
+      header.nnz, owner);
+  if constexpr (!Compressed<T, I>::kPattern) {
+    compressed->data = Array<T>(
+        reinterpret_cast<const T*>(buffer + header.data_offset()), header.nnz,
+        owner);
+  }
+  auto& indptr = compressed->indptr;
+  if (indptr[0] != 0 || indptr[header.major] != header.nnz ||
+      !std::is_sorted(indptr.begin(), indptr.end())) {
+    throw std::runtime_error("invalid matrix: corrupted indptr");
+  }
+  auto bound = header.axis == 0 ? header.i : header.j;
+  if (header.hypersparse) {
+    auto& majors = compressed->majors;
+    if (header.major == 0 || majors[header.major - 1] > bound ||
+        std::adjacent_find(majors.begin(), majors.end(),
+                           std::greater_equal<I>()) != majors.end()) {
+      throw std::runtime_error("invalid matrix: corrupted majors");
+    }
+  } else if (header.major != bound + 1 &&
+             (header.major != 0 || header.nnz != 0)) {
+    throw std::runtime_error("invalid matrix: corrupted major axis");
+  }
+  // The indices of each segment are sorted and bounded by the minor axis,
+  // so that the kernels index the arrays of the shape of the matrix.
+  auto& indices = compressed->indices;
+  auto minor = header.axis == 0 ? header.j : header.i;
+  for (size_t ix = 0; validate && ix < header.major; ++ix) {
+    for (auto kx = indptr[ix]; kx < indptr[ix + 1]; ++kx) {
+      if (indices[kx] > minor ||
+          (kx != indptr[ix] && indices[kx - 1] >= indices[kx])) {
+        throw std::runtime_error("invalid matrix: corrupted indices");
+      }
+    }
+  }
+  return {std::move(compressed), static_cast<I>(header.i),
+          static_cast<I>(header.j), header.transposed != 0};
+}
+
+// Binary format of the manifest of a partitioned matrix (see
+// partitioned.hpp), in native byte order: the magic number "SPMP", the
+// format version and the byte order mark (uint32), the number of shards
+// (uint64), then the bounds of their rows (shards + 1 uint64). Each shard is
+// stored in its own file in the format above.
+struct PartitionHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t padding;
+  uint64_t shards;
+
+  static constexpr char kMagic[4] = {'S', 'P', 'M', 'P'};
+  static constexpr uint32_t kVersion = 1;
+};
+
+static_assert(sizeof(PartitionHeader) == 24, "unexpected size of the header");
+
+// Writes the manifest of a partitioned matrix of bounds "bounds".
+inline auto write_partition(std::ostream& stream,
+                            const std::vector<uint64_t>& bounds) -> void {
+  auto header = PartitionHeader{};
+  std::memcpy(header.magic, PartitionHeader::kMagic, sizeof(header.magic));
+  header.version = PartitionHeader::kVersion;
+  header.byte_order = Header::kByteOrder;
+  header.shards = bounds.size() - 1;
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  stream.write(reinterpret_cast<const char*>(bounds.data()),
+               bounds.size() * sizeof(uint64_t));
+  if (!stream) {
+    throw std::runtime_error("unable to write the matrix");
+  }
+}
+
+// Reads the bounds of the shards from the manifest of a partitioned matrix.
+inline auto read_partition(const char* buffer, const size_t size)
+    -> std::vector<uint64_t> {
+  auto header = PartitionHeader{};
+  if (size < sizeof(header)) {
+    throw std::runtime_error("invalid partitioned matrix: truncated header");
+  }
+  std::memcpy(&header, buffer, sizeof(header));
+  if (std::memcmp(header.magic, PartitionHeader::kMagic,
+                  sizeof(header.magic)) != 0) {
+    throw std::runtime_error("invalid partitioned matrix: bad magic number");
+  }
+  if (header.version != PartitionHeader::kVersion) {
+    throw std::runtime_error("unsupported partitioned matrix format version " +
+                             std::to_string(header.version));
+  }
+  if (header.byte_order != Header::kByteOrder) {
+    throw std::runtime_error(
+        "invalid partitioned matrix: unsupported byte order");
+  }
+  if (header.shards == 0 ||
+      (size - sizeof(header)) / sizeof(uint64_t) != header.shards + 1) {
+    throw std::runtime_error("invalid partitioned matrix: truncated data");
+  }
+  auto bounds = std::vector<uint64_t>(header.shards + 1);
+  std::memcpy(bounds.data(), buffer + sizeof(header),
+              bounds.size() * sizeof(uint64_t));
+  return bounds;
+}
+
+// Content of a file, aligned on 8 bytes.
+struct File {
+  const char* data;
+  size_t size;
+  // Object keeping the content alive.
+  std::shared_ptr<const void> owner;
+};
+
+// Copies a buffer of any alignment into a File.
+inline auto copy_buffer(const char* buffer, const size_t size) -> File {
+  // Buffer of 64-bit words to get aligned arrays.
+  auto copy = std::make_shared<std::vector<uint64_t>>((size + 7) / 8);
+  if (size != 0) {
+    std::memcpy(copy->data(), buffer, size);
+  }
+  return {reinterpret_cast<const char*>(copy->data()), size, copy};
+}
+
+// Reads a file, or maps it in memory if "mmap" is true: the arrays of the
+// snapshot it holds are then read from the page cache, shared between
+// processes.
+inline auto open_file(const std::string& path, const bool mmap) -> File {
+#ifndef _WIN32
+  if (mmap) {
+    // Mapping of a file in memory, released with the last array using it.
+    struct Mapping {
+      void* address{MAP_FAILED};
+      size_t size{0};
+      ~Mapping() {
+        if (address != MAP_FAILED) {
+          munmap(address, size);
+        }
+      }
+    };
+
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error("unable to open " + path + ": " +
+                               std::strerror(errno));
+    }
+    struct stat status;
+    auto mapping = std::make_shared<Mapping>();
+    if (::fstat(fd, &status) == 0 && status.st_size > 0) {
+      mapping->size = static_cast<size_t>(status.st_size);
+      mapping->address =
+          ::mmap(nullptr, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    auto error = errno;
+    ::close(fd);
+    if (mapping->address == MAP_FAILED) {
+      throw std::runtime_error("unable to map " + path + ": " +
+                               std::strerror(error));
+    }
+    return {static_cast<const char*>(mapping->address), mapping->size,
+            mapping};
+  }
+#endif
+  auto stream = std::ifstream(path, std::ios::binary | std::ios::ate);
+  if (!stream) {
+    throw std::runtime_error("unable to open " + path);
+  }
+  auto size = static_cast<size_t>(stream.tellg());
+  // Buffer of 64-bit words to get aligned arrays.
+  auto buffer = std::make_shared<std::vector<uint64_t>>((size + 7) / 8);
+  stream.seekg(0);
+  stream.read(reinterpret_cast<char*>(buffer->data()), size);
+  if (!stream) {
+    throw std::runtime_error("unable to read " + path);
+  }
+  return {reinterpret_cast<const char*>(buffer->data()), size, buffer};
+}
+
+// Reads the header of a file.
+inline auto read_header(const std::string& path) -> Header {
+  auto stream = std::ifstream(path, std::ios::binary);
+  if (!stream) {
+    throw std::runtime_error("unable to open " + path);
+  }
+  char buffer[sizeof(Header)];
+  stream.read(buffer, sizeof(buffer));
+  return Header::read(buffer, static_cast<size_t>(stream.gcount()));
+}
@@ -0,0 +1,327 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include "flat_map.hpp"
+#include "parallel.hpp"
+
+// Hash table split into independent shards selected by the high bits of the
+// hash of the key, so that the shards can be filled concurrently. Each shard
+// is protected by its own readers-writer lock: "lookup" and "update" can be
+// called from several threads. The other accessors ("find", iteration) must
+// be protected by a "ReadLock".
+template <typename T, typename K = uint64_t>
+class ShardedMap {
+ public:
+  using Shard = FlatMap<T, K>;
+  using Slot = typename Shard::Slot;
+
+  // Item of a bulk update.
+  struct Update {
+    K key;
+    T value;
+  };
+
+  static constexpr size_t kBits = 6;
+  static constexpr size_t kShards = size_t(1) << kBits;
+
+  // Shared lock of all the shards, freezing the content of the table.
+  class ReadLock {
+   public:
+    explicit ReadLock(const ShardedMap& map) {
+      for (size_t ix = 0; ix < kShards; ++ix) {
+        locks_[ix] = std::shared_lock<std::shared_mutex>(map.mutexes_[ix].item);
+      }
+    }
+
+   private:
+    std::array<std::shared_lock<std::shared_mutex>, kShards> locks_;
+  };
+
+  template <typename Map, typename ShardIterator, typename Value>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Value;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Value*;
+    using reference = Value&;
+
+    Iterator(Map* map, size_t ix)
+        : map_(map), ix_(ix), it_(map->shards_[0].end()) {
+      if (ix_ < kShards) {
+        it_ = map_->shards_[ix_].begin();
+        skip();
+      }
+    }
+
+    auto operator*() const -> reference { return *it_; }
+    auto operator->() const -> pointer { return &*it_; }
+
+    auto operator++() -> Iterator& {
+      ++it_;
+      skip();
+      return *this;
+    }
+
+    auto operator==(const Iterator& rhs) const -> bool {
+      return ix_ == rhs.ix_ && (ix_ == kShards || it_ == rhs.it_);
+    }
+    auto operator!=(const Iterator& rhs) const -> bool {
+      return !(*this == rhs);
+    }
+
+   private:
+    auto skip() -> void {
+      while (it_ == map_->shards_[ix_].end()) {
+        if (++ix_ == kShards) {
+          return;
+        }
+        it_ = map_->shards_[ix_].begin();
+      }
+    }
+
+    Map* map_;
+    size_t ix_;
+    ShardIterator it_;
+  };
+
+  using iterator = Iterator<ShardedMap, typename Shard::iterator, Slot>;
+  using const_iterator =
+      Iterator<const ShardedMap, typename Shard::const_iterator, const Slot>;
+
+  ShardedMap() = default;
+
+  // Copies the shards concurrently, each one under its lock.
+  ShardedMap(const ShardedMap& rhs) {
+    parallel_for(kShards, ::num_threads(rhs.size(), kScanGrain),
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto lock = std::shared_lock<std::shared_mutex>(
+                         rhs.mutexes_[ix].item);
+                     shards_[ix] = rhs.shards_[ix];
+                   }
+                 });
+  }
+
+  auto operator=(const ShardedMap&) -> ShardedMap& = delete;
+
+  // Index of the shard storing a key.
+  static auto shard_of(const K& key) -> size_t {
+    return Shard::hash(key) >> (64 - kBits);
+  }
+
+  auto begin() -> iterator { return iterator(this, 0); }
+  auto end() -> iterator { return iterator(this, kShards); }
+  auto begin() const -> const_iterator { return const_iterator(this, 0); }
+  auto end() const -> const_iterator { return const_iterator(this, kShards); }
+
+  auto shard(const size_t ix) -> Shard& { return shards_[ix]; }
+  auto shard(const size_t ix) const -> const Shard& { return shards_[ix]; }
+
+  auto size() const -> size_t {
+    auto result = size_t(0);
+    for (size_t ix = 0; ix < kShards; ++ix) {
+      auto lock = std::shared_lock<std::shared_mutex>(mutexes_[ix].item);
+      result += shards_[ix].size();
+    }
+    return result;
+  }
+
+  auto empty() const -> bool { return size() == 0; }
+
+  // Number of slots of the shards.
+  auto capacity() const -> size_t {
+    auto result = size_t(0);
+    for (size_t ix = 0; ix < kShards; ++ix) {
+      auto lock = std::shared_lock<std::shared_mutex>(mutexes_[ix].item);
+      result += shards_[ix].capacity();
+    }
+    return result;
+  }
+
+  auto memory_usage() const -> size_t {
+    auto result = size_t(0);
+    for (size_t ix = 0; ix < kShards; ++ix) {
+      auto lock = std::shared_lock<std::shared_mutex>(mutexes_[ix].item);
+      result += shards_[ix].memory_usage();
+    }
+    return result;
+  }
+
+  // Copies the value stored for "key" into "value". Returns false if the
+  // key is not stored.
+  auto lookup(const K& key, T& value) const -> bool {
+    auto ix = shard_of(key);
+    auto lock = std::shared_lock<std::shared_mutex>(mutexes_[ix].item);
+    auto item = shards_[ix].find(key);
+    if (item == nullptr) {
+      return false;
+    }
+    value = *item;
+    return true;
+  }
+
+  auto find(const K& key) const -> const T* {
+    return shards_[shard_of(key)].find(key);
+  }
+
+  // Same as "find", "hash" being the hash of the key (see "Shard::hash").
+  auto find(const K& key, const uint64_t hash) const -> const T* {
+    return shards_[hash >> (64 - kBits)].find(key, hash);
+  }
+
+  // Prefetches the first slot probed for a key of hash "hash".
+  auto prefetch(const uint64_t hash) const -> void {
+    shards_[hash >> (64 - kBits)].prefetch(hash);
+  }
+
+  // Calls "op(shard, key, value)", "shard" being the table storing "key",
+  // locked exclusively.
+  template <typename Op>
+  auto update(const K& key, const T& value, const Op& op) -> void {
+    auto ix = shard_of(key);
+    auto lock = std::unique_lock<std::shared_mutex>(mutexes_[ix].item);
+    op(shards_[ix], key, value);
+  }
+
+  // Prepares the table to hold at least "n" entries, assuming the keys are
+  // evenly distributed among the shards.
+  auto reserve(const size_t n) -> void {
+    for (size_t ix = 0; ix < kShards; ++ix) {
+      auto lock = std::unique_lock<std::shared_mutex>(mutexes_[ix].item);
+      shards_[ix].reserve((n + kShards - 1) / kShards);
+    }
+  }
+
+  // Removes the entries for which "pred(slot)" is true, the shards being
+  // processed concurrently. Returns the number of entries removed.
+  template <typename Pred>
+  auto erase_if(const Pred& pred) -> size_t {
+    auto removed = std::array<size_t, kShards>();
+    parallel_for(kShards, ::num_threads(size(), kScanGrain),
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto lock = std::unique_lock<std::shared_mutex>(
+                         mutexes_[ix].item);
+                     removed[ix] = shards_[ix].erase_if(pred);
+                   }
+                 });
+    auto result = size_t(0);
+    for (auto item : removed) {
+      result += item;
+    }
+    return result;
+  }
+
+  // Reduces the capacity of each shard to the smallest one holding its
+  // entries.
+  auto shrink_to_fit() -> void {
+    parallel_for(kShards, ::num_threads(size(), kScanGrain),
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto lock = std::unique_lock<std::shared_mutex>(
+                         mutexes_[ix].item);
+                     shards_[ix].shrink_to_fit();
+                   }
+                 });
+  }
+
+  // Updates "n" items, "item(ix)" returning the Update (key, value) of the
+  // item "ix": calls "op(shard, key, value)" (see above). The items sharing
+  // a key are processed in order, so that the result does not depend on the
+  // number of threads. The items are dispatched between the shards, then the
+  // shards are filled concurrently. The shards are reserved for the new
+  // entries unless "insert" is false (e.g. for removals).
+  template <typename Item, typename Op>
+  auto update(const size_t n, const Item& item, const Op& op,
+              const bool insert = true) -> void {
+    auto threads = ::num_threads(n, kUpdateGrain);
+
+    // Counts the items belonging to each shard, for each range of items
+    // processed by a thread.
+    auto counts = std::vector<std::array<size_t, kShards>>(threads);
+    parallel_for(n, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto& count = counts[rank];
+                   count.fill(0);
+                   for (auto ix = first; ix < last; ++ix) {
+                     ++count[shard_of(item(ix).key)];
+                   }
+                 });
+
+    if (threads == 1) {
+      auto locks = std::array<std::unique_lock<std::shared_mutex>, kShards>();
+      for (size_t sx = 0; sx < kShards; ++sx) {
+        locks[sx] = std::unique_lock<std::shared_mutex>(mutexes_[sx].item);
+        if (insert) {
+          shards_[sx].reserve(shards_[sx].size() + counts[0][sx]);
+        }
+      }
+      for (size_t ix = 0; ix < n; ++ix) {
+        auto slot = item(ix);
+        op(shards_[shard_of(slot.key)], slot.key, slot.value);
+      }
+      return;
+    }
+
+    // Offsets of the items of each (thread, shard) in the buffer. The ranges
+    // are sorted by shard then by thread, which keeps the items of a shard
+    // in their original order.
+    auto offsets = std::vector<std::array<size_t, kShards>>(threads);
+    auto bounds = std::array<size_t, kShards + 1>();
+    bounds[0] = 0;
+    for (size_t sx = 0; sx < kShards; ++sx) {
+      auto offset = bounds[sx];
+      for (size_t rank = 0; rank < threads; ++rank) {
+        offsets[rank][sx] = offset;
+        offset += counts[rank][sx];
+      }
+      bounds[sx + 1] = offset;
+    }
+
+    auto buffer = std::vector<Update>(n);
+    parallel_for(n, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto& offset = offsets[rank];
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto slot = item(ix);
+                     buffer[offset[shard_of(slot.key)]++] = slot;
+                   }
+                 });
+
+    parallel_for(kShards, threads,
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto sx = first; sx < last; ++sx) {
+                     auto lock = std::unique_lock<std::shared_mutex>(
+                         mutexes_[sx].item);
+                     auto& shard = shards_[sx];
+                     if (insert) {
+                       shard.reserve(shard.size() + bounds[sx + 1] -
+                                     bounds[sx]);
+                     }
+                     for (auto ix = bounds[sx]; ix < bounds[sx + 1]; ++ix) {
+                       op(shard, buffer[ix].key, buffer[ix].value);
+                     }
+                   }
+                 });
+  }
+
+ private:
+  // Minimum number of items processed by a thread, for the updates of the
+  // table and the scans of its shards (see "Matrix").
+  static constexpr size_t kUpdateGrain = 1 << 12;
+  static constexpr size_t kScanGrain = 1 << 15;
+
+  // Lock of a shard, aligned on a cache line to avoid false sharing.
+  struct alignas(64) Mutex {
+    std::shared_mutex item;
+  };
+
+  std::array<Shard, kShards> shards_;
+  mutable std::array<Mutex, kShards> mutexes_;
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Indices "start", "start + step", ... selected along an axis by a Python
+// slice or a scalar index. A negative step is stored as its two's
+// complement, as done by pybind11::slice::compute.
+struct Slice {
+  size_t start;
+  size_t step;
+  size_t length;
+
+  auto operator[](const size_t k) const -> size_t { return start + k * step; }
+
+  auto reversed() const -> bool { return static_cast<int64_t>(step) < 0; }
+
+  // Position of "index" in the slice. Returns false if the slice does not
+  // contain the index.
+  auto position(const size_t index, size_t& k) const -> bool {
+    auto offset = static_cast<int64_t>(index - start);
+    auto _step = static_cast<int64_t>(step);
+    if (offset % _step != 0) {
+      return false;
+    }
+    auto ix = offset / _step;
+    if (ix < 0 || static_cast<size_t>(ix) >= length) {
+      return false;
+    }
+    k = static_cast<size_t>(ix);
+    return true;
+  }
+
+  auto unit() const -> bool { return step == 1; }
+
+  // Index "k" of a slice known to have a step of 1 if "kUnit".
+  template <bool kUnit>
+  auto at(const size_t k) const -> size_t {
+    return kUnit ? start + k : start + k * step;
+  }
+
+  // Same as "position", for a slice known to have a step of 1 if "kUnit":
+  // a subtraction and a comparison instead of a division.
+  template <bool kUnit>
+  auto locate(const size_t index, size_t& k) const -> bool {
+    if constexpr (kUnit) {
+      k = index - start;
+      return k < length;
+    } else {
+      return position(index, k);
+    }
+  }
+};
+
+// Calls "f(unit_rows, unit_cols)", the arguments being std::true_type if the
+// slice has a step of 1 and std::false_type otherwise: the kernels given as
+// "f" are compiled for each case (see "Slice::locate").
+template <typename F>
+auto dispatch_steps(const Slice& rows, const Slice& cols, F&& f) -> void {
+  if (rows.unit()) {
+    if (cols.unit()) {
+      f(std::true_type(), std::true_type());
+    } else {
+      f(std::true_type(), std::false_type());
+    }
+  } else if (cols.unit()) {
+    f(std::false_type(), std::true_type());
+  } else {
+    f(std::false_type(), std::false_type());
+  }
+}
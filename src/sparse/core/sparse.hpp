@@ -1,79 +1,1987 @@
-#include <boost/functional/hash.hpp>
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <pybind11/pybind11.h>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <tuple>
-#include <unordered_map>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "compressed.hpp"
+#include "filter.hpp"
+#include "parallel.hpp"
+#include "serialization.hpp"
+#include "sharded_map.hpp"
+#include "slice.hpp"
+#include "stats.hpp"
+#include "tiled.hpp"
+#include "types.hpp"
 
-namespace std {
+// Sparse matrix. The methods can be called concurrently from several
+// threads: readers and writers of the entries share the lock of the matrix
+// and synchronize on the locks of the shards of the hash table, while the
+// operations changing the layout of the matrix (freeze, thaw, transpose) lock
+// it exclusively. "T" is the type of the values and "I" the type of the
+// indices; a boolean matrix only stores the keys of its true entries.
+template <typename T = double, typename I = uint32_t>
+class Matrix {
+ public:
+  using Compressed = ::Compressed<T, I>;
+  using Snapshot = ::Snapshot<T, I>;
+  using Tiled = ::Tiled<T, I>;
+  using Key = std::tuple<I, I>;
+  using Packed = typename Packing<I>::Key;
+  using Map = ShardedMap<T, Packed>;
+  using Shard = typename Map::Shard;
 
-template <typename... T>
-struct hash<tuple<T...>> {
-  size_t operator()(tuple<T...> const& arg) const noexcept {
-    return boost::hash_value(arg);
-  }
-};
+  static constexpr bool kPattern = Compressed::kPattern;
 
-}  // namespace std
+  // Largest index of the rows and columns: the shape of the matrix, one past
+  // its largest indices, is a pair of indices.
+  static constexpr I kMaxIndex = std::numeric_limits<I>::max() - 1;
 
-class Matrix {
- public:
-  using Key = std::tuple<uint32_t, uint32_t>;
-  using Map = std::unordered_map<Key, double>;
+  // Type of the sums of values.
+  using Sum =
+      std::conditional_t<std::is_floating_point<T>::value, double, int64_t>;
 
   Matrix() = default;
 
-  auto set(const Key& key, const double x) -> void {
+  // Copies share the storage of the matrix until one of them is modified:
+  // the copy costs O(1), the storage being cloned by the first write through
+  // a shared handle. The copy waits for the writes in progress.
+  Matrix(const Matrix& rhs) {
+    auto lock = std::unique_lock<std::shared_mutex>(rhs.mutex_);
+    copy_unlocked(rhs);
+  }
+
+  auto operator=(const Matrix& rhs) -> Matrix& {
+    if (this != &rhs) {
+      auto lock = std::scoped_lock(mutex_, rhs.mutex_);
+      copy_unlocked(rhs);
+    }
+    return *this;
+  }
+
+  // Sets the entry "key" to "x". Setting an entry of a boolean matrix to
+  // false removes it.
+  auto set(const Key& key, const T x) -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = write_lock();
     const auto& _key = ji_ ? Matrix::swap_key(key) : key;
-    i_ = std::max(std::get<0>(_key), i_);
-    j_ = std::max(std::get<1>(_key), j_);
-    data_->insert_or_assign(_key, x);
+    Matrix::check_limit(_key);
+    Matrix::update_max(i_, std::get<0>(_key));
+    Matrix::update_max(j_, std::get<1>(_key));
+    remember(Matrix::pack(_key));
+    data_->update(Matrix::pack(_key), x, Matrix::assign);
   }
 
-  auto get(const Key& key, const bool filter = false) const -> double {
+  // Adds "x" to the entry "key" (logical or for a boolean matrix).
+  auto add(const Key& key, const T x) -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = write_lock();
     const auto& _key = ji_ ? Matrix::swap_key(key) : key;
-    if (data_->count(_key) == 0) {
-      if (filter) {
-        return std::numeric_limits<double>::quiet_NaN();
-      }
-      auto i = std::get<0>(_key);
-      if (i > i_) {
-        throw pybind11::index_error("index " + std::to_string(i) +
-                                    " is out of bounds for axis " +
-                                    std::to_string(ji_ ? 1 : 0) +
-                                    " with size " + std::to_string(i_ + 1));
+    Matrix::check_limit(_key);
+    Matrix::update_max(i_, std::get<0>(_key));
+    Matrix::update_max(j_, std::get<1>(_key));
+    remember(Matrix::pack(_key));
+    data_->update(Matrix::pack(_key), x, Matrix::accumulate);
+  }
+
+  // Sets the "n" entries (i[k], j[k]) to x[k]. When an index is repeated,
+  // the last value is kept.
+  auto set(const I* i, const I* j, const T* x, const size_t n) -> void {
+    update(i, j, x, n, Matrix::assign);
+  }
+
+  // Adds x[k] to the "n" entries (i[k], j[k]). The values of a repeated
+  // index are summed in order.
+  auto add(const I* i, const I* j, const T* x, const size_t n) -> void {
+    update(i, j, x, n, Matrix::accumulate);
+  }
+
+  // Assigns a dense block to the window selected by "rows" and "cols", the
+  // value at the position (ix, jx) of the window being
+  // x[ix * strides.first + jx * strides.second]. The values equal to
+  // "absent" are not stored: the entries stored at their positions are
+  // removed if "erase" is true, kept otherwise.
+  auto set_block(const Slice& rows, const Slice& cols, const T* x,
+                 const std::pair<ptrdiff_t, ptrdiff_t>& strides,
+                 const T absent, const bool erase) -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = write_lock();
+    auto value = [&](const size_t ix, const size_t jx) -> T {
+      return x[static_cast<ptrdiff_t>(ix) * strides.first +
+               static_cast<ptrdiff_t>(jx) * strides.second];
+    };
+    auto threads = num_threads(rows.length * cols.length, kUpdateGrain);
+
+    // Number of values stored by each row of the block, so that the buffer
+    // of the entries and the shards are allocated once.
+    auto offsets = std::vector<size_t>(rows.length + 1, 0);
+    parallel_for(rows.length, threads,
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto count = size_t(0);
+                     if (strides.second == 1) {
+                       // Contiguous row: a loop the compiler vectorizes.
+                       auto* row = &x[static_cast<ptrdiff_t>(ix) *
+                                      strides.first];
+                       for (size_t jx = 0; jx < cols.length; ++jx) {
+                         count += row[jx] != absent;
+                       }
+                     } else {
+                       for (size_t jx = 0; jx < cols.length; ++jx) {
+                         count += value(ix, jx) != absent;
+                       }
+                     }
+                     offsets[ix + 1] = count;
+                   }
+                 });
+    for (size_t ix = 0; ix < rows.length; ++ix) {
+      offsets[ix + 1] += offsets[ix];
+    }
+    auto size = offsets[rows.length];
+    auto missing = rows.length * cols.length - size;
+
+    // The missing values are removed one by one if they are fewer than the
+    // stored entries, otherwise by a sweep of the stored entries.
+    auto sweep = erase && missing > data_->size();
+    if (sweep) {
+      dispatch_steps(rows, cols, [&](auto unit_rows, auto unit_cols) {
+        data_->erase_if([&](const typename Map::Slot& slot) {
+          auto index = Packing<I>::split(slot.key);
+          if (ji_) {
+            std::swap(index.first, index.second);
+          }
+          size_t ix, jx;
+          return rows.locate<unit_rows>(index.first, ix) &&
+                 cols.locate<unit_cols>(index.second, jx) &&
+                 value(ix, jx) == absent;
+        });
+      });
+    }
+    auto removals = std::vector<typename Map::Update>(
+        erase && !sweep ? missing : 0);
+
+    auto entries = std::vector<typename Map::Update>(size);
+    auto bounds = std::vector<Key>(threads, Key{0, 0});
+    // Fills the entries of the rows [first, last), the layout of the keys
+    // and the step of the columns being fixed for the whole block.
+    auto fill = [&](auto transposed, auto unit_cols, const size_t rank,
+                    const size_t first, const size_t last) {
+      auto pack = [](const I i, const I j) -> Packed {
+        return decltype(transposed)::value ? Packing<I>::pack(j, i)
+                                           : Packing<I>::pack(i, j);
+      };
+      auto& bound = bounds[rank];
+      for (auto ix = first; ix < last; ++ix) {
+        auto i = static_cast<I>(rows[ix]);
+        auto kx = offsets[ix];
+        auto rx = ix * cols.length - offsets[ix];
+        auto j = I(0);
+        for (size_t jx = 0; jx < cols.length; ++jx) {
+          auto x = value(ix, jx);
+          auto col = static_cast<I>(cols.at<unit_cols>(jx));
+          if (x != absent) {
+            j = std::max(j, col);
+            entries[kx++] = {pack(i, col), x};
+          } else if (!removals.empty()) {
+            removals[rx++] = {pack(i, col), x};
+          }
+        }
+        if (offsets[ix] != offsets[ix + 1]) {
+          std::get<0>(bound) = std::max(std::get<0>(bound), i);
+          std::get<1>(bound) = std::max(std::get<1>(bound), j);
+        }
       }
-      auto j = std::get<1>(_key);
-      if (j > j_) {
-        throw pybind11::index_error("index " + std::to_string(j) +
-                                    " is out of bounds for axis " +
-                                    std::to_string(ji_ ? 0 : 1) +
-                                    " with size " + std::to_string(j_ + 1));
+    };
+    if (size != 0 || !removals.empty()) {
+      parallel_for(
+          rows.length, threads,
+          [&](const size_t rank, const size_t first, const size_t last) {
+            dispatch_steps(rows, cols, [&](auto, auto unit_cols) {
+              if (ji_) {
+                fill(std::true_type(), unit_cols, rank, first, last);
+              } else {
+                fill(std::false_type(), unit_cols, rank, first, last);
+              }
+            });
+          });
+    }
+    if (!removals.empty()) {
+      data_->update(
+          removals.size(), [&](const size_t ix) { return removals[ix]; },
+          [](Shard& shard, const Packed& key, const T) { shard.erase(key); },
+          false);
+    }
+    if (size == 0) {
+      return;
+    }
+    for (auto& item : bounds) {
+      Matrix::check_limit(item);
+    }
+    for (auto& item : bounds) {
+      Matrix::update_max(ji_ ? j_ : i_, std::get<0>(item));
+      Matrix::update_max(ji_ ? i_ : j_, std::get<1>(item));
+    }
+    remember(size, [&](const size_t ix) { return entries[ix].key; });
+    data_->update(
+        size, [&](const size_t ix) { return entries[ix]; }, Matrix::assign);
+  }
+
+  // Removes the "n" entries (i[k], j[k]). The entries not stored are
+  // ignored. The bounds of the matrix are kept (see "compact").
+  auto erase(const I* i, const I* j, const size_t n) -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = write_lock();
+    if (ji_) {
+      std::swap(i, j);
+    }
+    data_->update(
+        n,
+        [&](const size_t ix) -> typename Map::Update {
+          return {Matrix::pack({i[ix], j[ix]}), T(0)};
+        },
+        [](Shard& shard, const Packed& key, const T) { shard.erase(key); },
+        false);
+  }
+
+  // Removes the entries whose absolute value is lower than or equal to
+  // "tolerance". Returns the number of entries removed.
+  auto prune(const double tolerance = 0) -> size_t {
+    auto lock = write_lock();
+    return data_->erase_if([&](const typename Map::Slot& slot) {
+      return std::abs(static_cast<double>(slot.value)) <= tolerance;
+    });
+  }
+
+  // Releases the memory left unused by the removed entries, and shrinks the
+  // shape of the matrix to the largest indices stored.
+  auto compact() -> void {
+    auto lock = std::unique_lock<std::shared_mutex>(mutex_);
+    if (!frozen_ && !tiled_) {
+      if (data_.use_count() > 1) {
+        // The table is read by the copies of the matrix sharing it (see the
+        // copy constructor): the matrix shrinks its own clone.
+        data_ = std::make_shared<Map>(*data_);
       }
-      return 0;
+      data_->shrink_to_fit();
+    }
+    auto bounds = std::make_pair(I(0), I(0));
+    for_each_stored([&](const Packed& key, const T) {
+      auto index = Packing<I>::split(key);
+      bounds.first = std::max(bounds.first, index.first);
+      bounds.second = std::max(bounds.second, index.second);
+    });
+    auto major = frozen_ && frozen_->axis == 1 ? j_.load() : i_.load();
+    i_ = bounds.first;
+    j_ = bounds.second;
+    drop_sorted();
+    if (filter_) {
+      // The bits of the removed entries are cleared.
+      filter_ = build_filter();
+    }
+    if (frozen_ && major != (frozen_->axis == 0 ? i_ : j_)) {
+      // The segments past the new bound are dropped.
+      frozen_ = compress(frozen_->axis);
+    }
+  }
+
+  // Sizes the hash table for "n" entries, so that inserting them does not
+  // rehash it.
+  auto reserve(const size_t n) -> void {
+    auto lock = write_lock();
+    data_->reserve(n);
+  }
+
+  // Maintains an occupancy filter of the stored entries, using about "bits"
+  // bits per entry (see filter.hpp), so that most lookups of entries not
+  // stored, and the reads of empty rows, skip the storage. The filter is
+  // disabled if "bits" is 0.
+  auto set_filter(const double bits) -> void {
+    if (!(bits >= 0)) {
+      throw std::invalid_argument(
+          "the number of bits per entry must be non-negative");
+    }
+    auto lock = std::unique_lock<std::shared_mutex>(mutex_);
+    filter_bits_ = bits;
+    filter_ = bits == 0 ? nullptr : build_filter();
+  }
+
+  // Value of the entry "key", zero if it is not stored. Throws an
+  // IndexError if the index is out of the bounds of the matrix.
+  auto get(const Key& key) const -> T {
+    auto value = T(0);
+    if (!get(key, value)) {
+      auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+      check_bounds(ji_ ? Matrix::swap_key(key) : key);
+    }
+    return value;
+  }
+
+  // Copies the value of the entry "key" to "value" if it is stored, returns
+  // false otherwise.
+  auto get(const Key& key, T& value) const -> bool {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    const auto& _key = ji_ ? Matrix::swap_key(key) : key;
+    return lookup(Matrix::pack(_key), value);
+  }
+
+  // Gathers the values of the "n" entries (i[k], j[k]) into x[k], the
+  // entries not stored being set to "fill". The lookups in the hash table
+  // are processed by batches: the slots probed by the keys of a batch are
+  // prefetched before being searched, so that the cache misses overlap.
+  auto take(const I* i, const I* j, const size_t n, const T fill, T* x) const
+      -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    if (ji_) {
+      std::swap(i, j);
     }
-    return (*data_)[_key];
+    parallel_for(
+        n, num_threads(n, kLookupGrain),
+        [&](const size_t, const size_t first, const size_t last) {
+          if (frozen_ || tiled_) {
+            for (auto ix = first; ix < last; ++ix) {
+              auto value = T(0);
+              x[ix] = find(Matrix::pack({i[ix], j[ix]}), value) ? value : fill;
+            }
+            return;
+          }
+          Packed keys[kBatch];
+          uint64_t hashes[kBatch];
+          bool stored[kBatch];
+          for (auto begin = first; begin < last; begin += kBatch) {
+            auto size = std::min(kBatch, last - begin);
+            for (size_t ix = 0; ix < size; ++ix) {
+              keys[ix] = Matrix::pack({i[begin + ix], j[begin + ix]});
+              hashes[ix] = Shard::hash(keys[ix]);
+              stored[ix] = present(hashes[ix]);
+              if (stored[ix]) {
+                data_->prefetch(hashes[ix]);
+              }
+            }
+            for (size_t ix = 0; ix < size; ++ix) {
+              auto item =
+                  stored[ix] ? data_->find(keys[ix], hashes[ix]) : nullptr;
+              x[begin + ix] = item != nullptr ? *item : fill;
+            }
+          }
+        });
+  }
+
+  // Throws an IndexError if the index is out of the bounds of the matrix.
+  auto check_index(const Key& key) const -> void {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    check_bounds(ji_ ? Matrix::swap_key(key) : key);
   }
 
   auto shape() const -> Key {
-    if (data_->empty()) {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    if (nnz_unlocked() == 0) {
       return {0, 0};
     }
     if (ji_) {
-      return std::make_tuple(j_ + 1, i_ + 1);
+      return std::make_tuple(static_cast<I>(j_ + 1), static_cast<I>(i_ + 1));
+    }
+    return std::make_tuple(static_cast<I>(i_ + 1), static_cast<I>(j_ + 1));
+  }
+
+  auto transpose() -> void {
+    auto lock = std::unique_lock<std::shared_mutex>(mutex_);
+    ji_ = !ji_;
+  }
+
+  // Transposed copy of the matrix, sharing its storage (see the copy
+  // constructor).
+  auto transposed() const -> Matrix {
+    auto result = Matrix(*this);
+    result.ji_ = !result.ji_;
+    return result;
+  }
+
+  // Converts the stored entries into a compressed storage, compressed along
+  // the rows (CSR) or the columns (CSC) of the matrix. The matrix becomes
+  // read-only until the next call to "thaw" or "set".
+  auto freeze(const bool csc = false) -> void {
+    auto lock = std::unique_lock<std::shared_mutex>(mutex_);
+    auto axis = csc != ji_ ? 1 : 0;
+    if (frozen_) {
+      if (frozen_->axis == axis) {
+        return;
+      }
+      thaw_unlocked();
     }
-    return std::make_tuple(i_ + 1, j_ + 1);
+    frozen_ = sorted_unlocked(axis);
+    drop_sorted();
+    tiled_.reset();
+    data_ = std::make_shared<Map>();
   }
 
-  auto transpose() -> void { ji_ = !ji_; }
+  // Converts the stored entries into a tiled storage (see tiled.hpp), suited
+  // to the reads of rectangular windows. The matrix becomes read-only until
+  // the next call to "thaw" or "set".
+  auto tile() -> void {
+    auto lock = std::unique_lock<std::shared_mutex>(mutex_);
+    if (tiled_) {
+      return;
+    }
+    {
+      auto read_lock = this->read_lock();
+      tiled_ = std::make_shared<Tiled>(
+          Tiled::build(nnz_unlocked(), [&](const auto& f) {
+            for_each_stored(f);
+          }));
+    }
+    frozen_.reset();
+    data_ = std::make_shared<Map>();
+  }
+
+  // Restores the mutable storage of a frozen matrix.
+  auto thaw() -> void {
+    auto lock = std::unique_lock<std::shared_mutex>(mutex_);
+    thaw_unlocked();
+  }
+
+  auto frozen() const -> bool {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    return frozen_ || tiled_;
+  }
+
+  // Compressed storage of the matrix, compressed along its rows (CSR) or its
+  // columns (CSC), never hypersparse. The snapshot of a frozen matrix is
+  // returned if it has the requested layout.
+  auto compressed(const bool csc = false) const
+      -> std::shared_ptr<const Compressed> {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto axis = csc != ji_ ? 1 : 0;
+    auto result = sorted_unlocked(axis);
+    if (result->hypersparse()) {
+      auto major = (axis == 0 ? i_ : j_) + size_t(1);
+      result = std::make_shared<Compressed>(result->expand(major));
+    }
+    return result;
+  }
+
+  // Compressed storage of the matrix, possibly hypersparse, holding its
+  // entries in row-major order (column-major order if "csc"). The storage is
+  // cached until the entries are modified, so that repeated exports only
+  // sort the entries once.
+  auto sorted(const bool csc = false) const
+      -> std::shared_ptr<const Compressed> {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    return sorted_unlocked(csc != ji_ ? 1 : 0);
+  }
+
+  // Coordinates (i, j, x) of the stored entries, in storage order.
+  auto coo() const -> std::tuple<std::vector<I>, std::vector<I>,
+                                 std::vector<Storage<T>>> {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    auto n = nnz_unlocked();
+    auto i = std::vector<I>(n);
+    auto j = std::vector<I>(n);
+    auto x = std::vector<Storage<T>>(n);
+    auto ix = size_t(0);
+    for_each_unlocked([&](const I row, const I col, const T value) {
+      i[ix] = row;
+      j[ix] = col;
+      x[ix] = value;
+      ++ix;
+    });
+    return std::make_tuple(std::move(i), std::move(j), std::move(x));
+  }
+
+  // Builds a matrix from its compressed storage: "indptr" holds "major + 1"
+  // offsets into "indices" and "data", arrays of "size" items. Duplicate
+  // entries are summed.
+  static auto from_compressed(const int64_t* indptr, const size_t major,
+                              const I* indices, const T* data,
+                              const size_t size, const bool csc = false)
+      -> Matrix {
+    if (indptr[0] != 0) {
+      throw std::invalid_argument("the first item of indptr must be 0");
+    }
+    if (indptr[major] < 0 || static_cast<size_t>(indptr[major]) != size) {
+      throw std::invalid_argument(
+          "the last item of indptr must be equal to the size of data");
+    }
+    auto nnz = size;
+    auto other = std::vector<I>(nnz);
+    for (size_t ix = 0; ix < major; ++ix) {
+      if (indptr[ix] < 0 || indptr[ix] > indptr[ix + 1]) {
+        throw std::invalid_argument("indptr must be a non-decreasing array");
+      }
+      if (indptr[ix] != indptr[ix + 1]) {
+        Matrix::check_limit(ix);
+      }
+      std::fill(other.begin() + indptr[ix], other.begin() + indptr[ix + 1],
+                static_cast<I>(ix));
+    }
+    auto result = Matrix();
+    if (csc) {
+      result.add(indices, other.data(), data, nnz);
+    } else {
+      result.add(other.data(), indices, data, nnz);
+    }
+    return result;
+  }
+
+  // Rows of a matrix computed by a thread: the non-empty rows in ascending
+  // order, the number of entries of each row, and their columns and values.
+  struct Rows {
+    std::vector<I> majors;
+    std::vector<uint64_t> counts;
+    std::vector<I> indices;
+    std::vector<Storage<T>> data;
+  };
+
+  // Builds a matrix of shape "shape" frozen in CSR layout from the rows
+  // computed by the threads, each thread holding rows following those of
+  // the previous one. The rows are released. The storage is hypersparse if
+  // it holds more rows than entries; the matrix is a transposed view of it
+  // if "transposed".
+  static auto from_rows(std::vector<Rows>& rows, const Key& shape,
+                        const bool transposed = false) -> Matrix {
+    auto size = size_t(0);
+    auto segments = size_t(0);
+    for (auto& item : rows) {
+      size += item.indices.size();
+      segments += item.majors.size();
+    }
+    auto result = Snapshot();
+    result.i = std::get<0>(shape) == 0 ? 0 : std::get<0>(shape) - 1;
+    result.j = std::get<1>(shape) == 0 ? 0 : std::get<1>(shape) - 1;
+    result.transposed = transposed;
+    auto major = size == 0 ? 0 : result.i + size_t(1);
+    auto hypersparse = major > size;
+    auto indptr = std::vector<uint64_t>(hypersparse ? segments + 1 : major + 1);
+    auto majors = std::vector<I>();
+    auto indices = std::vector<I>();
+    auto data = std::vector<T>();
+    indices.reserve(size);
+    data.reserve(kPattern ? 0 : size);
+    auto segment = size_t(0);
+    for (auto& item : rows) {
+      for (size_t ix = 0; ix < item.majors.size(); ++ix) {
+        auto position = hypersparse ? segment++ : item.majors[ix];
+        indptr[position + 1] = item.counts[ix];
+      }
+      if (hypersparse) {
+        majors.insert(majors.end(), item.majors.begin(), item.majors.end());
+      }
+      indices.insert(indices.end(), item.indices.begin(), item.indices.end());
+      if constexpr (!kPattern) {
+        data.insert(data.end(), item.data.begin(), item.data.end());
+      }
+      item = Rows();
+    }
+    for (size_t ix = 1; ix < indptr.size(); ++ix) {
+      indptr[ix] += indptr[ix - 1];
+    }
+    auto compressed = std::make_shared<Compressed>();
+    compressed->indptr = Array<uint64_t>(std::move(indptr));
+    if (hypersparse) {
+      compressed->majors = Array<I>(std::move(majors));
+    }
+    compressed->indices = Array<I>(std::move(indices));
+    if constexpr (!kPattern) {
+      compressed->data = Array<T>(std::move(data));
+    }
+    result.compressed = std::move(compressed);
+    return Matrix(std::move(result));
+  }
+
+  // Writes the matrix to a file, compressed along the axis of its snapshot if
+  // it is frozen, along its rows otherwise.
+  auto save(const std::string& path) const -> void {
+    auto stream = std::ofstream(path, std::ios::binary | std::ios::trunc);
+    if (!stream) {
+      throw std::runtime_error("unable to create " + path);
+    }
+    write_snapshot(stream, snapshot());
+  }
+
+  // Loads a matrix written by "save". The matrix is frozen on the content of
+  // the file: if "mmap" is true, the entries are read from the mapped pages,
+  // shared with the other processes mapping the file, until the matrix is
+  // modified. The indices are checked if "validate" is true, which reads all
+  // of them (see "read_snapshot").
+  static auto load(const std::string& path, const bool mmap = true,
+                   const bool validate = false) -> Matrix {
+    auto file = open_file(path, mmap);
+    return Matrix(
+        read_snapshot<T, I>(file.data, file.size, file.owner, validate));
+  }
+
+  // Same as "save" and "load", using a bytes buffer.
+  auto dumps() const -> std::string {
+    auto stream = std::ostringstream();
+    write_snapshot(stream, snapshot());
+    return stream.str();
+  }
+
+  // The buffer being copied anyway, its indices are checked.
+  static auto loads(const char* buffer, const size_t size) -> Matrix {
+    auto file = copy_buffer(buffer, size);
+    return Matrix(
+        read_snapshot<T, I>(file.data, file.size, file.owner, true));
+  }
+
+  // Computes y += A x, "x" being a dense matrix of shape (cols, k) and "y" a
+  // dense matrix of shape (rows, k), both stored in row-major order. The
+  // entries of A lying outside (rows, cols) are ignored. The products are
+  // computed in double precision whatever the type of the values.
+  auto dot(const double* x, const size_t cols, const size_t k, double* y,
+           const size_t rows) const -> void {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+
+    auto accumulate = [&](double* y, const size_t i, const size_t j,
+                          const T value) {
+      if (i < rows && j < cols) {
+        auto row = y + i * k;
+        auto col = x + j * k;
+        auto a = static_cast<double>(value);
+        for (size_t ix = 0; ix < k; ++ix) {
+          row[ix] += a * col[ix];
+        }
+      }
+    };
+
+    auto nnz = nnz_unlocked();
+    auto threads = num_threads(nnz, kScanGrain);
+
+    if (frozen_ && (frozen_->axis == 1) == ji_) {
+      // Compressed along the rows: each thread computes a block of rows,
+      // holding about the same number of entries.
+      auto& indptr = frozen_->indptr;
+      parallel_for(
+          nnz, threads,
+          [&](const size_t, const size_t first, const size_t last) {
+            auto begin = std::upper_bound(indptr.begin(), indptr.end(),
+                                          first) - indptr.begin() - 1;
+            for (auto ix = begin; ix < static_cast<int64_t>(frozen_->major());
+                 ++ix) {
+              if (indptr[ix] >= last) {
+                break;
+              }
+              if (indptr[ix] < first) {
+                continue;
+              }
+              for (auto kx = indptr[ix]; kx < indptr[ix + 1]; ++kx) {
+                accumulate(y, frozen_->index(ix), frozen_->indices[kx],
+                           frozen_->value(kx));
+              }
+            }
+          });
+      return;
+    }
+
+    // The entries updating a row are spread over the storage: each thread
+    // accumulates into its own copy of y, merged at the end. Threads are
+    // only worth using if they process more entries than the size of y.
+    auto size = rows * k;
+    threads = std::max(std::min(threads, nnz / std::max(size, size_t(1))),
+                       size_t(1));
+    auto partials = std::vector<std::vector<double>>(threads - 1);
+    auto units = units_unlocked();
+    parallel_for(units, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto _y = y;
+                   if (rank != 0) {
+                     partials[rank - 1].assign(size, 0);
+                     _y = partials[rank - 1].data();
+                   }
+                   if (frozen_) {
+                     auto& indptr = frozen_->indptr;
+                     for (auto ix = first; ix < last; ++ix) {
+                       auto j = frozen_->index(ix);
+                       for (auto kx = indptr[ix]; kx < indptr[ix + 1]; ++kx) {
+                         accumulate(_y, frozen_->indices[kx], j,
+                                    frozen_->value(kx));
+                       }
+                     }
+                     return;
+                   }
+                   for_each_unit(first, last,
+                                 [&](const I i, const I j, const T value) {
+                                   if (ji_) {
+                                     accumulate(_y, j, i, value);
+                                   } else {
+                                     accumulate(_y, i, j, value);
+                                   }
+                                 });
+                 });
+    parallel_for(size, threads,
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto& item : partials) {
+                     for (auto ix = first; ix < last; ++ix) {
+                       y[ix] += item[ix];
+                     }
+                   }
+                 });
+  }
+
+  // Calls "f(i, j, x)" for each stored entry, indices expressed in the
+  // current orientation of the matrix. The matrix is locked during the
+  // iteration: "f" must not modify it.
+  template <typename F>
+  auto for_each(F&& f) const -> void {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    for_each_unlocked(f);
+  }
+
+  // Calls "f(ix, jx, x)" for each stored entry of the window selected by
+  // "rows" and "cols", "ix" and "jx" being the positions of the entry in
+  // these slices. The entries are visited in the row-major order of the
+  // window. The matrix is locked during the extraction: "f" must not modify
+  // it.
+  template <typename F>
+  auto extract(const Slice& rows, const Slice& cols, F&& f) const -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    auto emit = [&](const size_t ix, const size_t jx, const T x) {
+      SPARSE_STAT(returned, 1);
+      f(ix, jx, x);
+    };
+    if (frozen_ && (frozen_->axis == 1) == ji_) {
+      extract_rows(rows, cols, emit);
+      return;
+    }
+
+    struct Item {
+      size_t ix;
+      size_t jx;
+      T x;
+    };
+    auto items = std::vector<Item>();
+    size_t ix, jx;
+
+    if (tiled_) {
+      extract_tiles(rows, cols, 1,
+                    [&](const size_t ix, const size_t jx, const T x) {
+                      items.push_back({ix, jx, x});
+                    });
+    } else if (frozen_) {
+      // The major axis holds the columns: scan the selected columns.
+      extract_cols(rows, cols, 0, cols.length,
+                   [&](const size_t ix, const size_t jx, const T x) {
+                     items.push_back({ix, jx, x});
+                   });
+    } else if (cols.length != 0 && rows.length > nnz_unlocked() / cols.length) {
+      // Walking the stored entries is cheaper than probing each cell as soon
+      // as the window covers more cells than there are entries.
+      SPARSE_STAT(cells, nnz_unlocked());
+      dispatch_steps(rows, cols, [&](auto unit_rows, auto unit_cols) {
+        for_each_unlocked([&](const I i, const I j, const T x) {
+          if (rows.locate<unit_rows>(i, ix) && cols.locate<unit_cols>(j, jx)) {
+            items.push_back({ix, jx, x});
+          }
+        });
+      });
+    } else {
+      for (ix = 0; ix < rows.length; ++ix) {
+        if (!ji_ && !maybe_stored_row(static_cast<I>(rows[ix]))) {
+          continue;
+        }
+        SPARSE_STAT(cells, cols.length);
+        for (jx = 0; jx < cols.length; ++jx) {
+          auto key = std::make_tuple(static_cast<I>(rows[ix]),
+                                     static_cast<I>(cols[jx]));
+          auto value = T(0);
+          if (find(Matrix::pack(ji_ ? Matrix::swap_key(key) : key), value)) {
+            emit(ix, jx, value);
+          }
+        }
+      }
+      return;
+    }
+
+    std::sort(items.begin(), items.end(), [](const Item& lhs, const Item& rhs) {
+      return std::tie(lhs.ix, lhs.jx) < std::tie(rhs.ix, rhs.jx);
+    });
+    for (auto& item : items) {
+      emit(item.ix, item.jx, item.x);
+    }
+  }
+
+  // Elementwise sum of two matrices (logical or for boolean matrices), the
+  // entries not stored counting as zeros. The copy of the operand holding the
+  // most entries is updated with the entries of the other one.
+  auto plus(const Matrix& rhs) const -> Matrix {
+    auto swap = nnz() < rhs.nnz();
+    auto& large = swap ? rhs : *this;
+    auto& small = swap ? *this : rhs;
+    auto result = Matrix(large);
+    auto coo = small.coo();
+    auto& x = std::get<2>(coo);
+    result.add(std::get<0>(coo).data(), std::get<1>(coo).data(),
+               reinterpret_cast<const T*>(x.data()), x.size());
+    result.grow(small.shape());
+    return result;
+  }
+
+  // Elementwise (Hadamard) product of two matrices (logical and for boolean
+  // matrices). The entries of the operand holding the fewest entries are
+  // looked up in the other one. The products equal to zero are not stored.
+  auto multiply(const Matrix& rhs) const -> Matrix {
+    auto swap = rhs.nnz() < nnz();
+    auto& large = swap ? *this : rhs;
+    auto& small = swap ? rhs : *this;
+    auto coo = small.coo();
+    auto& i = std::get<0>(coo);
+    auto& j = std::get<1>(coo);
+    auto& x = std::get<2>(coo);
+    auto y = std::unique_ptr<T[]>(new T[x.size()]);
+    large.take(i.data(), j.data(), x.size(), T(0), y.get());
+
+    // The entries missing from "large" read as 0 and are skipped, their
+    // product with an infinite value being NaN.
+    auto n = size_t(0);
+    for (size_t ix = 0; ix < x.size(); ++ix) {
+      auto value = kPattern || y[ix] == T(0)
+                       ? T(y[ix])
+                       : static_cast<T>(T(x[ix]) * y[ix]);
+      if (value != T(0)) {
+        i[n] = i[ix];
+        j[n] = j[ix];
+        x[n] = value;
+        ++n;
+      }
+    }
+    auto result = Matrix();
+    result.set(i.data(), j.data(), reinterpret_cast<const T*>(x.data()), n);
+    result.grow(shape());
+    result.grow(rhs.shape());
+    return result;
+  }
+
+  // Matrix product, computed row by row (Gustavson) from the storages of the
+  // operands compressed along their rows, which are used in place if the
+  // operands are frozen in this layout. The rows are processed concurrently,
+  // each thread summing the products of a row into a dense array indexed by
+  // column, or into a hash table if the product has too many columns. The
+  // product is returned frozen in CSR layout.
+  auto matmul(const Matrix& rhs) const -> Matrix {
+    auto lhs_shape = shape();
+    auto rhs_shape = rhs.shape();
+    auto a = rows_storage();
+    auto b = rhs.rows_storage();
+
+    // Number of products of each row of "a", used to balance the threads.
+    auto offsets = std::vector<uint64_t>(a->major() + 1, 0);
+    parallel_for(a->major(), num_threads(a->size(), kScanGrain),
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto count = uint64_t(0);
+                     for (auto kx = a->indptr[ix]; kx < a->indptr[ix + 1];
+                          ++kx) {
+                       auto range = b->segment(a->indices[kx]);
+                       count += range.second - range.first;
+                     }
+                     offsets[ix + 1] = count;
+                   }
+                 });
+    for (size_t ix = 0; ix < a->major(); ++ix) {
+      offsets[ix + 1] += offsets[ix];
+    }
+    auto products = offsets.back();
+    auto threads = num_threads(products, kLookupGrain);
+    auto cols = static_cast<size_t>(std::get<1>(rhs_shape));
+
+    auto rows = std::vector<Rows>(threads);
+    parallel_for(
+        products, threads,
+        [&](const size_t rank, const size_t first, const size_t last) {
+          auto& out = rows[rank];
+          auto dense = cols <= kDenseColumns;
+          auto values = std::vector<Storage<T>>(dense ? cols : 0);
+          auto marks = std::vector<bool>(dense ? cols : 0);
+          auto table = FlatMap<T, uint64_t>();
+          auto touched = std::vector<I>();
+
+          auto begin = std::upper_bound(offsets.begin(), offsets.end() - 1,
+                                        first) - offsets.begin() - 1;
+          for (auto ix = static_cast<size_t>(begin); ix < a->major(); ++ix) {
+            if (offsets[ix] >= last) {
+              break;
+            }
+            if (offsets[ix] < first || offsets[ix] == offsets[ix + 1]) {
+              continue;
+            }
+            for (auto kx = a->indptr[ix]; kx < a->indptr[ix + 1]; ++kx) {
+              auto x = a->value(kx);
+              auto range = b->segment(a->indices[kx]);
+              for (auto lx = range.first; lx < range.second; ++lx) {
+                auto j = b->indices[lx];
+                if (dense) {
+                  if (!marks[j]) {
+                    marks[j] = true;
+                    values[j] = Storage<T>(0);
+                    touched.push_back(j);
+                  }
+                  Matrix::multiply_add(values[j], x, b->value(lx));
+                } else if constexpr (kPattern) {
+                  table.emplace(j);
+                } else {
+                  table[j] += x * b->value(lx);
+                }
+              }
+            }
+            if (!dense) {
+              for (auto& item : table) {
+                touched.push_back(static_cast<I>(item.key));
+              }
+            }
+            std::sort(touched.begin(), touched.end());
+            for (auto j : touched) {
+              out.indices.push_back(j);
+              if constexpr (!kPattern) {
+                out.data.push_back(dense ? values[j] : *table.find(j));
+              }
+              if (dense) {
+                marks[j] = false;
+              } else {
+                table.erase(j);
+              }
+            }
+            if (!touched.empty()) {
+              out.majors.push_back(a->index(ix));
+              out.counts.push_back(touched.size());
+            }
+            touched.clear();
+          }
+        });
+
+    return Matrix::from_rows(rows, {std::get<0>(lhs_shape),
+                                    std::get<1>(rhs_shape)});
+  }
+
+  // Copies the window selected by "rows" and "cols" into the dense row-major
+  // array "x" of rows.length * cols.length values, the cells holding no
+  // entry being set to zero. The rows (or the columns, the tiles or the
+  // shards) are processed concurrently.
+  //
+  // A mutable matrix is read either by walking its stored entries or by
+  // probing each cell of the window, whichever visits fewer items weighted
+  // by their cost: a probe costs about kProbeCost times the visit of a
+  // stored entry (see benchmarks/window.py).
+  auto gather(const Slice& rows, const Slice& cols, T* x) const -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto cells = rows.length * cols.length;
+    std::fill(x, x + cells, T(0));
+    if (cells == 0) {
+      return;
+    }
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    auto write = [&](const size_t ix, const size_t jx, const T value) {
+      SPARSE_STAT(returned, 1);
+      x[ix * cols.length + jx] = value;
+    };
+
+    if (frozen_ && (frozen_->axis == 1) == ji_) {
+      parallel_for(rows.length, num_threads(cells, kCopyGrain),
+                   [&](const size_t, const size_t first, const size_t last) {
+                     for (auto ix = first; ix < last; ++ix) {
+                       extract_row(ix, rows, cols, write);
+                     }
+                   });
+      return;
+    }
+    if (frozen_) {
+      // The major axis holds the columns: scan the selected columns.
+      parallel_for(cols.length, num_threads(cells, kCopyGrain),
+                   [&](const size_t, const size_t first, const size_t last) {
+                     extract_cols(rows, cols, first, last, write);
+                   });
+      return;
+    }
+    if (tiled_) {
+      extract_tiles(rows, cols, num_threads(cells, kCopyGrain), write);
+      return;
+    }
+
+    auto size = data_->size();
+    if (cells * kProbeCost > size) {
+      parallel_for(Map::kShards, num_threads(size, kScanGrain),
+                   [&](const size_t, const size_t first, const size_t last) {
+                     dispatch_steps(rows, cols, [&](auto unit_rows,
+                                                    auto unit_cols) {
+                       size_t ix, jx;
+                       for (auto sx = first; sx < last; ++sx) {
+                         SPARSE_STAT(cells, data_->shard(sx).size());
+                         for (auto& item : data_->shard(sx)) {
+                           auto index = Packing<I>::split(item.key);
+                           if (ji_) {
+                             std::swap(index.first, index.second);
+                           }
+                           if (rows.locate<unit_rows>(index.first, ix) &&
+                               cols.locate<unit_cols>(index.second, jx)) {
+                             write(ix, jx, item.value);
+                           }
+                         }
+                       }
+                     });
+                   });
+      return;
+    }
+    parallel_for(
+        rows.length, num_threads(cells, kLookupGrain),
+        [&](const size_t, const size_t first, const size_t last) {
+          dispatch_steps(rows, cols, [&](auto, auto unit_cols) {
+            Packed keys[kBatch];
+            uint64_t hashes[kBatch];
+            bool stored[kBatch];
+            for (auto ix = first; ix < last; ++ix) {
+              auto i = static_cast<I>(rows[ix]);
+              if (!ji_ && !maybe_stored_row(i)) {
+                continue;
+              }
+              SPARSE_STAT(cells, cols.length);
+              for (size_t begin = 0; begin < cols.length; begin += kBatch) {
+                auto n = std::min(kBatch, cols.length - begin);
+                for (size_t jx = 0; jx < n; ++jx) {
+                  auto j = static_cast<I>(cols.at<unit_cols>(begin + jx));
+                  keys[jx] =
+                      ji_ ? Packing<I>::pack(j, i) : Packing<I>::pack(i, j);
+                  hashes[jx] = Shard::hash(keys[jx]);
+                  stored[jx] = present(hashes[jx]);
+                  if (stored[jx]) {
+                    data_->prefetch(hashes[jx]);
+                  }
+                }
+                for (size_t jx = 0; jx < n; ++jx) {
+                  auto item = stored[jx] ? data_->find(keys[jx], hashes[jx])
+                                         : nullptr;
+                  if (item != nullptr) {
+                    write(ix, begin + jx, *item);
+                  }
+                }
+              }
+            }
+          });
+        });
+  }
+
+  // Reductions along "axis": 0 reduces the rows (one result per column), 1
+  // the columns (one result per row) and -1 all the entries (a single
+  // result). The entries not stored count as zeros. The sums of floating
+  // point values are computed in double precision, the sums of integers and
+  // booleans as 64-bit integers.
+  auto sum(const int axis) const -> std::vector<Sum> {
+    return reduce<Sum>(
+               axis, Sum(0), [](const T x) { return static_cast<Sum>(x); },
+               [](const Sum lhs, const Sum rhs) { return lhs + rhs; })
+        .values;
+  }
+
+  // Number of stored entries not equal to zero along "axis".
+  auto count_nonzero(const int axis) const -> std::vector<int64_t> {
+    return reduce<int64_t>(
+               axis, int64_t(0),
+               [](const T x) { return static_cast<int64_t>(x != T(0)); },
+               [](const int64_t lhs, const int64_t rhs) { return lhs + rhs; })
+        .values;
+  }
+
+  auto mean(const int axis) const -> std::vector<double> {
+    auto reduction = reduce<Sum>(
+        axis, Sum(0), [](const T x) { return static_cast<Sum>(x); },
+        [](const Sum lhs, const Sum rhs) { return lhs + rhs; });
+    auto result = std::vector<double>(reduction.values.size());
+    for (size_t ix = 0; ix < result.size(); ++ix) {
+      result[ix] = static_cast<double>(reduction.values[ix]) /
+                   static_cast<double>(reduction.length);
+    }
+    return result;
+  }
+
+  auto max(const int axis) const -> std::vector<Storage<T>> {
+    return extremum(axis, std::numeric_limits<T>::lowest(),
+                    [](const Storage<T> lhs, const Storage<T> rhs) {
+                      return std::max(lhs, rhs);
+                    });
+  }
+
+  auto min(const int axis) const -> std::vector<Storage<T>> {
+    return extremum(axis, std::numeric_limits<T>::max(),
+                    [](const Storage<T> lhs, const Storage<T> rhs) {
+                      return std::min(lhs, rhs);
+                    });
+  }
+
+  // Number of stored entries.
+  auto nnz() const -> size_t {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    return nnz_unlocked();
+  }
+
+  // Number of bytes used by the parts of a matrix.
+  struct MemoryUsage {
+    // The matrix object and the hash table object (headers and locks of the
+    // shards).
+    size_t object{0};
+    // Slots of the hash table holding an entry, or not.
+    size_t entries{0};
+    size_t slack{0};
+    // Arrays of the compressed storage.
+    size_t indptr{0};
+    size_t majors{0};
+    size_t indices{0};
+    size_t data{0};
+    // Tiled storage.
+    size_t tiles{0};
+    // Sorted storages cached by the exports (see "sorted").
+    size_t sorted{0};
+    // Occupancy filter (see "set_filter").
+    size_t filter{0};
+
+    auto total() const -> size_t {
+      return object + entries + slack + indptr + majors + indices + data +
+             tiles + sorted + filter;
+    }
+  };
+
+  // Memory used by the matrix. The storage shared with copies of the matrix
+  // is counted by each of them.
+  auto memory_usage() const -> MemoryUsage {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    auto result = MemoryUsage();
+    result.object = sizeof(*this) + sizeof(Map);
+    result.entries = data_->size() * sizeof(typename Map::Slot);
+    result.slack = data_->memory_usage() - result.entries;
+    if (frozen_) {
+      result.indptr = frozen_->indptr.size() * sizeof(uint64_t);
+      result.majors = frozen_->majors.size() * sizeof(I);
+      result.indices = frozen_->indices.size() * sizeof(I);
+      result.data = frozen_->data.size() * sizeof(T);
+    }
+    if (tiled_) {
+      result.tiles = tiled_->memory_usage();
+    }
+    if (filter_) {
+      result.filter = filter_->memory_usage();
+    }
+    auto sorted_lock = std::lock_guard<std::mutex>(sorted_mutex_);
+    for (auto& item : sorted_) {
+      if (item) {
+        result.sorted += item->indptr.size() * sizeof(uint64_t) +
+                         item->majors.size() * sizeof(I) +
+                         item->indices.size() * sizeof(I) +
+                         item->data.size() * sizeof(T);
+      }
+    }
+    return result;
+  }
+
+  // Number of bytes used by the matrix.
+  auto nbytes() const -> size_t { return memory_usage().total(); }
+
+  // Counters of the calls made on the matrix (see stats.hpp), all zero
+  // unless the library is compiled with SPARSE_STATS. The counters are reset
+  // if "reset" is true.
+  auto stats(const bool reset = false) const -> Stats {
+    auto lock = std::lock_guard<std::mutex>(stats_mutex_);
+    auto result = stats_;
+    if (reset) {
+      stats_ = Stats();
+    }
+    return result;
+  }
+
+  // Ratio of the entries to the slots of the hash table.
+  auto load_factor() const -> double {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto capacity = data_->capacity();
+    return capacity ? static_cast<double>(data_->size()) / capacity : 0;
+  }
 
  private:
+  // Minimum number of items processed by a thread, by kind of operation,
+  // for a thread to process them for some 100 us, much longer than its
+  // dispatch by the scheduler: the updates of the hash table (random
+  // writes), its lookups (random reads, prefetched by batch), the scans of
+  // stored entries and the copies of contiguous cells.
+  static constexpr size_t kUpdateGrain = 1 << 12;
+  static constexpr size_t kLookupGrain = 1 << 13;
+  static constexpr size_t kScanGrain = 1 << 15;
+  static constexpr size_t kCopyGrain = 1 << 16;
+
+  // Adds the counters of the calling thread (see "local_stats"), from its
+  // construction to its destruction, to the counters of a matrix.
+  class Recorder {
+   public:
+#ifdef SPARSE_STATS
+    explicit Recorder(const Matrix& matrix)
+        : matrix_(matrix), start_(local_stats()) {}
+    ~Recorder() {
+      auto delta = local_stats() - start_;
+      auto lock = std::lock_guard<std::mutex>(matrix_.stats_mutex_);
+      matrix_.stats_ += delta;
+    }
+
+   private:
+    const Matrix& matrix_;
+    Stats start_;
+#else
+    explicit Recorder(const Matrix&) {}
+#endif
+  };
+
+  // Number of lookups whose probes are prefetched together.
+  static constexpr size_t kBatch = 16;
+  // Cost of probing a cell of a window relative to the visit of a stored
+  // entry (see "gather").
+  static constexpr size_t kProbeCost = 4;
+  // Smallest number of keys an occupancy filter is sized for.
+  static constexpr size_t kMinFilterCapacity = 1 << 12;
+
+  static auto pack(const Key& key) -> Packed {
+    return Packing<I>::pack(std::get<0>(key), std::get<1>(key));
+  }
+
   static auto swap_key(const Key& key) -> Key {
     return std::make_tuple(std::get<1>(key), std::get<0>(key));
   }
 
+  // Number of columns of a matrix product up to which the products of a row
+  // are summed into a dense array (see "matmul").
+  static constexpr size_t kDenseColumns = size_t(1) << 22;
+
+  // sum += x * y (sum |= x & y for booleans).
+  static auto multiply_add(Storage<T>& sum, const T x, const T y) -> void {
+    if constexpr (kPattern) {
+      sum = sum || (x && y);
+    } else {
+      sum += x * y;
+    }
+  }
+
+  static auto update_max(std::atomic<I>& bound, const I value) -> void {
+    auto current = bound.load(std::memory_order_relaxed);
+    while (current < value &&
+           !bound.compare_exchange_weak(current, value,
+                                        std::memory_order_relaxed)) {
+    }
+  }
+
+  static auto assign(Shard& shard, const Packed& key, const T x) -> void {
+    if constexpr (kPattern) {
+      if (x) {
+        shard.emplace(key);
+      } else {
+        shard.erase(key);
+      }
+    } else {
+      shard[key] = x;
+    }
+  }
+
+  static auto accumulate(Shard& shard, const Packed& key, const T x) -> void {
+    if constexpr (kPattern) {
+      if (x) {
+        shard.emplace(key);
+      }
+    } else {
+      shard[key] += x;
+    }
+  }
+
+  // Updates the entries (i[k], j[k]) with x[k], calling
+  // "op(shard, key, x[k])".
+  template <typename Op>
+  auto update(const I* i, const I* j, const T* x, const size_t n,
+              const Op& op) -> void {
+    [[maybe_unused]] auto recorder = Recorder(*this);
+    auto lock = write_lock();
+    if (ji_) {
+      std::swap(i, j);
+    }
+    auto threads = num_threads(n, kUpdateGrain);
+    auto bounds = std::vector<Key>(threads, Key{0, 0});
+    parallel_for(n, threads,
+                 [&](const size_t rank, const size_t first, const size_t last) {
+                   auto& bound = bounds[rank];
+                   for (auto ix = first; ix < last; ++ix) {
+                     std::get<0>(bound) = std::max(std::get<0>(bound), i[ix]);
+                     std::get<1>(bound) = std::max(std::get<1>(bound), j[ix]);
+                   }
+                 });
+    // The indices are checked before any bound is extended.
+    for (auto& item : bounds) {
+      Matrix::check_limit(item);
+    }
+    for (auto& item : bounds) {
+      Matrix::update_max(i_, std::get<0>(item));
+      Matrix::update_max(j_, std::get<1>(item));
+    }
+    remember(n, [&](const size_t ix) { return Matrix::pack({i[ix], j[ix]}); });
+    data_->update(
+        n,
+        [&](const size_t ix) -> typename Map::Update {
+          return {Matrix::pack({i[ix], j[ix]}), x[ix]};
+        },
+        op);
+  }
+
+  // Adds a key about to be stored to the occupancy filter, if any.
+  auto remember(const Packed& key) -> void {
+    if (filter_) {
+      filter_->count(1);
+      filter_->insert(Shard::hash(key), Packing<I>::split(key).first);
+    }
+  }
+
+  // Same as above for the "n" keys "key(ix)".
+  template <typename F>
+  auto remember(const size_t n, const F& key) -> void {
+    if (!filter_) {
+      return;
+    }
+    filter_->count(n);
+    parallel_for(n, num_threads(n, kUpdateGrain),
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto ix = first; ix < last; ++ix) {
+                     auto item = key(ix);
+                     filter_->insert(Shard::hash(item),
+                                     Packing<I>::split(item).first);
+                   }
+                 });
+  }
+
+  // Occupancy filter of the stored entries, sized for twice their number.
+  auto build_filter() const -> std::shared_ptr<Filter> {
+    auto read_lock = this->read_lock();
+    auto size = nnz_unlocked();
+    auto result = std::make_shared<Filter>(
+        std::max(2 * size, kMinFilterCapacity), filter_bits_);
+    result->count(size);
+    for_each_stored([&](const Packed& key, const T) {
+      result->insert(Shard::hash(key), Packing<I>::split(key).first);
+    });
+    return result;
+  }
+
+  // Returns false if the entry "key" is not stored, according to the
+  // occupancy filter.
+  auto maybe_stored(const Packed& key) const -> bool {
+    return !filter_ || present(Shard::hash(key));
+  }
+
+  // Same as above, "hash" being the hash of the key (see "Shard::hash").
+  auto present(const uint64_t hash) const -> bool {
+    if (filter_ && !filter_->contains(hash)) {
+      SPARSE_STAT(filtered, 1);
+      return false;
+    }
+    return true;
+  }
+
+  // Returns false if the row "i" of the storage holds no entries, according
+  // to the occupancy filter.
+  auto maybe_stored_row(const I i) const -> bool {
+    return !filter_ || filter_->has_row(i);
+  }
+
+  explicit Matrix(Snapshot snapshot)
+      : frozen_(std::move(snapshot.compressed)),
+        i_(snapshot.i),
+        j_(snapshot.j),
+        ji_(snapshot.transposed) {}
+
+  auto snapshot() const -> Snapshot {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    return {frozen_ ? frozen_ : compress(0), i_, j_, ji_};
+  }
+
+  // Shared lock of the matrix held by the methods modifying its entries
+  // (see "write_lock"). The version of the entries changes when the lock is
+  // acquired and when it is released.
+  class WriteLock {
+   public:
+    WriteLock(Matrix& matrix, std::shared_lock<std::shared_mutex> lock)
+        : matrix_(matrix), lock_(std::move(lock)) {
+      matrix_.touch();
+    }
+
+    WriteLock(const WriteLock&) = delete;
+    auto operator=(const WriteLock&) -> WriteLock& = delete;
+
+    ~WriteLock() { ++matrix_.version_; }
+
+   private:
+    Matrix& matrix_;
+    std::shared_lock<std::shared_mutex> lock_;
+  };
+
+  // Shared lock of the matrix, the storage being mutable and owned by the
+  // matrix alone: a frozen matrix is thawed, a storage shared with copies of
+  // the matrix is cloned.
+  auto write_lock() -> WriteLock {
+    while (true) {
+      auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+      auto stale = filter_ && (filter_->full() || filter_.use_count() > 1);
+      if (!frozen_ && !tiled_ && data_.use_count() == 1 && !stale) {
+        return WriteLock(*this, std::move(lock));
+      }
+      lock.unlock();
+      auto exclusive = std::unique_lock<std::shared_mutex>(mutex_);
+      if (frozen_ || tiled_) {
+        thaw_unlocked();
+      } else if (data_.use_count() > 1) {
+        data_ = std::make_shared<Map>(*data_);
+      } else if (filter_ && (filter_->full() || filter_.use_count() > 1)) {
+        // The filter is shared with copies of the matrix, or holds more keys
+        // than it was sized for.
+        filter_ = build_filter();
+      }
+    }
+  }
+
+  // Lock preventing the modification of the stored entries, the matrix
+  // being locked.
+  auto read_lock() const -> std::unique_ptr<typename Map::ReadLock> {
+    using ReadLock = typename Map::ReadLock;
+    return frozen_ || tiled_ ? nullptr : std::make_unique<ReadLock>(*data_);
+  }
+
+  // Storage compressed along the rows of the matrix, possibly hypersparse:
+  // the snapshot of a frozen matrix if it has this layout.
+  auto rows_storage() const -> std::shared_ptr<const Compressed> {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto axis = ji_ ? 1 : 0;
+    if (frozen_ && frozen_->axis == axis) {
+      return frozen_;
+    }
+    return compress(axis);
+  }
+
+  // Extends the bounds of the matrix to hold a matrix of shape "shape".
+  auto grow(const Key& shape) -> void {
+    if (std::get<0>(shape) == 0 || std::get<1>(shape) == 0) {
+      return;
+    }
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto key = std::make_tuple(static_cast<I>(std::get<0>(shape) - 1),
+                               static_cast<I>(std::get<1>(shape) - 1));
+    const auto& _key = ji_ ? Matrix::swap_key(key) : key;
+    Matrix::update_max(i_, std::get<0>(_key));
+    Matrix::update_max(j_, std::get<1>(_key));
+    // The sorted storages have segments for the previous shape.
+    touch();
+  }
+
+  // Compressed storage along the axis "axis" of the storage.
+  auto compress(const int axis) const -> std::shared_ptr<Compressed> {
+    auto read_lock = this->read_lock();
+    auto size = nnz_unlocked();
+    auto major = size == 0 ? 0 : (axis == 0 ? i_ : j_) + size_t(1);
+    return std::make_shared<Compressed>(
+        Compressed::build(size, axis, major, [&](const auto& f) {
+          for_each_stored(f);
+        }));
+  }
+
+  // Storage compressed along the axis "axis" of the storage, possibly
+  // hypersparse: the snapshot of a frozen matrix if it has this layout,
+  // otherwise the storage cached since the last modification of the entries.
+  auto sorted_unlocked(const int axis) const
+      -> std::shared_ptr<const Compressed> {
+    if (frozen_ && frozen_->axis == axis) {
+      return frozen_;
+    }
+    auto lock = std::lock_guard<std::mutex>(sorted_mutex_);
+    // The version is read before the entries: a write in progress changes
+    // it again once done.
+    auto version = version_.load();
+    if (!sorted_[axis] || sorted_version_[axis] != version) {
+      sorted_[axis] = compress(axis);
+      sorted_version_[axis] = version;
+      has_sorted_ = true;
+    }
+    return sorted_[axis];
+  }
+
+  // Changes the version of the entries, releasing the sorted storages.
+  // Shares the storage of "rhs", both matrices being locked.
+  auto copy_unlocked(const Matrix& rhs) -> void {
+    data_ = rhs.data_;
+    frozen_ = rhs.frozen_;
+    tiled_ = rhs.tiled_;
+    filter_ = rhs.filter_;
+    filter_bits_ = rhs.filter_bits_;
+    touch();
+    i_ = rhs.i_.load();
+    j_ = rhs.j_.load();
+    ji_ = rhs.ji_;
+  }
+
+  auto touch() -> void {
+    ++version_;
+    drop_sorted();
+  }
+
+  auto drop_sorted() const -> void {
+    if (has_sorted_) {
+      auto lock = std::lock_guard<std::mutex>(sorted_mutex_);
+      sorted_[0].reset();
+      sorted_[1].reset();
+      has_sorted_ = false;
+    }
+  }
+
+  auto nnz_unlocked() const -> size_t {
+    return frozen_ ? frozen_->size() : tiled_ ? tiled_->size() : data_->size();
+  }
+
+  auto thaw_unlocked() -> void {
+    if (!frozen_ && !tiled_) {
+      return;
+    }
+    auto data = std::make_shared<Map>();
+    data->reserve(nnz_unlocked());
+    for_each_stored([&](const Packed& key, const T x) {
+      data->update(key, x, Matrix::assign);
+    });
+    data_ = std::move(data);
+    frozen_.reset();
+    tiled_.reset();
+  }
+
+  template <typename F>
+  auto for_each_unlocked(F&& f) const -> void {
+    for_each_stored([&](const Packed& key, const T x) {
+      auto index = Packing<I>::split(key);
+      if (ji_) {
+        std::swap(index.first, index.second);
+      }
+      f(index.first, index.second, x);
+    });
+  }
+
+  // Throws an IndexError if an index of "key" is larger than "kMaxIndex".
+  static auto check_limit(const Key& key) -> void {
+    Matrix::check_limit(std::max(std::get<0>(key), std::get<1>(key)));
+  }
+
+  static auto check_limit(const uint64_t index) -> void {
+    if (index > kMaxIndex) {
+      throw pybind11::index_error("index " + std::to_string(index) +
+                                  " is out of bounds, the largest index is " +
+                                  std::to_string(kMaxIndex));
+    }
+  }
+
+  auto check_bounds(const Key& key) const -> void {
+    auto i = std::get<0>(key);
+    if (i > i_) {
+      throw pybind11::index_error("index " + std::to_string(i) +
+                                  " is out of bounds for axis " +
+                                  std::to_string(ji_ ? 1 : 0) + " with size " +
+                                  std::to_string(i_ + 1));
+    }
+    auto j = std::get<1>(key);
+    if (j > j_) {
+      throw pybind11::index_error("index " + std::to_string(j) +
+                                  " is out of bounds for axis " +
+                                  std::to_string(ji_ ? 0 : 1) + " with size " +
+                                  std::to_string(j_ + 1));
+    }
+  }
+
+  // Copies the value stored for "key" into "value". Returns false if the
+  // key is not stored.
+  auto find(const Packed& key, T& value) const -> bool {
+    if (!maybe_stored(key)) {
+      return false;
+    }
+    if (frozen_) {
+      auto index = Compressed::split(key, frozen_->axis);
+      auto ix = frozen_->search(index.first, index.second);
+      if (ix != -1) {
+        value = frozen_->value(static_cast<size_t>(ix));
+      }
+      return ix != -1;
+    }
+    if (tiled_) {
+      auto index = Packing<I>::split(key);
+      return tiled_->find(index.first, index.second, value);
+    }
+    auto item = data_->find(key);
+    if (item != nullptr) {
+      value = *item;
+    }
+    return item != nullptr;
+  }
+
+  // Result of a reduction: the reduced value and the number of stored
+  // entries of each line, and the number of cells of a line.
+  template <typename R>
+  struct Reduction {
+    std::vector<R> values;
+    std::vector<uint64_t> counts;
+    size_t length;
+  };
+
+  // Reduces the stored entries along "axis" (see "sum"), folding the values
+  // "map(x)" with the associative operation "op", starting from "init".
+  template <typename R, typename F, typename Op>
+  auto reduce(const int axis, const R init, const F& map, const Op& op) const
+      -> Reduction<R> {
+    auto lock = std::shared_lock<std::shared_mutex>(mutex_);
+    auto read_lock = this->read_lock();
+    auto nnz = nnz_unlocked();
+    auto rows = nnz == 0 ? 0 : i_ + size_t(1);
+    auto cols = nnz == 0 ? 0 : j_ + size_t(1);
+    // Axis of the storage indexing the results, -1 if there is a single one.
+    auto kept = axis == -1 ? -1 : ((axis == 0) != ji_ ? 1 : 0);
+    auto size = kept == -1 ? size_t(1) : (kept == 0 ? rows : cols);
+    auto result = Reduction<R>{
+        std::vector<R>(size, init), std::vector<uint64_t>(size, 0),
+        kept == -1 ? rows * cols : (kept == 0 ? cols : rows)};
+    auto threads = num_threads(nnz, kScanGrain);
+
+    if (frozen_ && frozen_->axis == kept) {
+      // Each result reduces a contiguous segment of the snapshot.
+      auto& indptr = frozen_->indptr;
+      parallel_for(frozen_->major(), threads,
+                   [&](const size_t, const size_t first, const size_t last) {
+                     for (auto ix = first; ix < last; ++ix) {
+                       auto index = frozen_->index(ix);
+                       result.counts[index] = indptr[ix + 1] - indptr[ix];
+                       result.values[index] = fold(indptr[ix], indptr[ix + 1],
+                                                   init, map, op);
+                     }
+                   });
+      return result;
+    }
+
+    // Each thread accumulates into its own copy of the results, merged at
+    // the end (see "dot").
+    threads = std::max(std::min(threads, nnz / std::max(size, size_t(1))),
+                       size_t(1));
+    auto partials = std::vector<Reduction<R>>(threads - 1);
+    auto units = units_unlocked();
+    parallel_for(
+        units, threads,
+        [&](const size_t rank, const size_t first, const size_t last) {
+          auto* partial = &result;
+          if (rank != 0) {
+            partial = &partials[rank - 1];
+            partial->values.assign(size, init);
+            partial->counts.assign(size, 0);
+          }
+          auto& values = partial->values;
+          auto& counts = partial->counts;
+          auto visit = [&](const I i, const I j, const T x) {
+            auto ix = kept == -1 ? size_t(0) : (kept == 0 ? i : j);
+            values[ix] = op(values[ix], map(x));
+            ++counts[ix];
+          };
+          if (frozen_) {
+            auto& indptr = frozen_->indptr;
+            for (auto ix = first; ix < last; ++ix) {
+              auto major = frozen_->index(ix);
+              for (auto kx = indptr[ix]; kx < indptr[ix + 1]; ++kx) {
+                auto minor = frozen_->indices[kx];
+                if (frozen_->axis == 0) {
+                  visit(major, minor, frozen_->value(kx));
+                } else {
+                  visit(minor, major, frozen_->value(kx));
+                }
+              }
+            }
+            return;
+          }
+          for_each_unit(first, last, visit);
+        });
+    parallel_for(size, threads,
+                 [&](const size_t, const size_t first, const size_t last) {
+                   for (auto& item : partials) {
+                     for (auto ix = first; ix < last; ++ix) {
+                       result.values[ix] =
+                           op(result.values[ix], item.values[ix]);
+                       result.counts[ix] += item.counts[ix];
+                     }
+                   }
+                 });
+    return result;
+  }
+
+  // Folds "map(x)" for the values stored at the positions [first, last) of
+  // the snapshot. Four independent accumulators break the dependency chain
+  // of the operation, letting the compiler vectorize the loop.
+  template <typename R, typename F, typename Op>
+  auto fold(const uint64_t first, const uint64_t last, const R init,
+            const F& map, const Op& op) const -> R {
+    R lanes[4] = {init, init, init, init};
+    auto kx = first;
+    for (; kx + 4 <= last; kx += 4) {
+      for (size_t ix = 0; ix < 4; ++ix) {
+        lanes[ix] = op(lanes[ix], map(frozen_->value(kx + ix)));
+      }
+    }
+    for (; kx < last; ++kx) {
+      lanes[0] = op(lanes[0], map(frozen_->value(kx)));
+    }
+    return op(op(lanes[0], lanes[1]), op(lanes[2], lanes[3]));
+  }
+
+  // Maximum or minimum along "axis", "op" selecting one of two values. The
+  // implicit zeros of a line take part in the selection unless the line is
+  // full.
+  template <typename Op>
+  auto extremum(const int axis, const T init, const Op& op) const
+      -> std::vector<Storage<T>> {
+    auto reduction = reduce<Storage<T>>(
+        axis, static_cast<Storage<T>>(init),
+        [](const T x) { return static_cast<Storage<T>>(x); }, op);
+    if (reduction.length == 0) {
+      throw std::invalid_argument(
+          "zero-size array to reduction operation which has no identity");
+    }
+    for (size_t ix = 0; ix < reduction.values.size(); ++ix) {
+      if (reduction.counts[ix] < reduction.length) {
+        reduction.values[ix] = op(reduction.values[ix], Storage<T>(0));
+      }
+    }
+    return std::move(reduction.values);
+  }
+
+  // Same as "find", locking the shard of the key.
+  auto lookup(const Packed& key, T& value) const -> bool {
+    if (frozen_ || tiled_) {
+      return find(key, value);
+    }
+    return maybe_stored(key) && data_->lookup(key, value);
+  }
+
+  // Calls "f(key, x)" for each stored entry, keys in storage order.
+  template <typename F>
+  auto for_each_stored(F&& f) const -> void {
+    if (tiled_) {
+      tiled_->for_each([&](const I i, const I j, const T x) {
+        f(Packing<I>::pack(i, j), x);
+      });
+      return;
+    }
+    if (!frozen_) {
+      for (auto& item : *data_) {
+        f(item.key, item.value);
+      }
+      return;
+    }
+    auto& indptr = frozen_->indptr;
+    for (size_t ix = 0; ix < frozen_->major(); ++ix) {
+      auto major = frozen_->index(ix);
+      for (auto kx = indptr[ix]; kx < indptr[ix + 1]; ++kx) {
+        f(frozen_->pack(major, frozen_->indices[kx]), frozen_->value(kx));
+      }
+    }
+  }
+
+  // Extraction of a window from a storage compressed along the rows.
+  template <typename F>
+  auto extract_rows(const Slice& rows, const Slice& cols, F& f) const -> void {
+    for (size_t ix = 0; ix < rows.length; ++ix) {
+      extract_row(ix, rows, cols, f);
+    }
+  }
+
+  // Extraction of the row "ix" of a window from a storage compressed along
+  // the rows.
+  template <typename F>
+  auto extract_row(const size_t ix, const Slice& rows, const Slice& cols,
+                   F& f) const -> void {
+    size_t jx;
+    if (cols.unit()) {
+      // Contiguous columns: their entries are a block of the segment.
+      auto block = frozen_->segment(rows[ix], cols.start,
+                                    cols.start + cols.length);
+      SPARSE_STAT(cells, block.second - block.first);
+      for (auto kx = block.first; kx < block.second; ++kx) {
+        f(ix, frozen_->indices[kx] - cols.start, frozen_->value(kx));
+      }
+      return;
+    }
+    auto range = frozen_->segment(rows[ix]);
+    auto n = range.second - range.first;
+    if (n == 0) {
+      return;
+    }
+    auto depth = size_t(0);
+    for (auto k = n; k != 0; k >>= 1) {
+      ++depth;
+    }
+    if (cols.length * depth < n) {
+      // Few columns selected: binary search for each of them.
+      SPARSE_STAT(cells, cols.length);
+      for (jx = 0; jx < cols.length; ++jx) {
+        auto kx = frozen_->search(rows[ix], cols[jx]);
+        if (kx != -1) {
+          f(ix, jx, frozen_->value(kx));
+        }
+      }
+    } else if (!cols.reversed()) {
+      SPARSE_STAT(cells, n);
+      for (auto kx = range.first; kx < range.second; ++kx) {
+        if (cols.position(frozen_->indices[kx], jx)) {
+          f(ix, jx, frozen_->value(kx));
+        }
+      }
+    } else {
+      SPARSE_STAT(cells, n);
+      for (auto kx = range.second; kx-- > range.first;) {
+        if (cols.position(frozen_->indices[kx], jx)) {
+          f(ix, jx, frozen_->value(kx));
+        }
+      }
+    }
+  }
+
+  // Extraction of the columns [first, last) of a window from a storage
+  // compressed along the columns.
+  template <typename F>
+  auto extract_cols(const Slice& rows, const Slice& cols, const size_t first,
+                    const size_t last, F&& f) const -> void {
+    size_t ix;
+    for (auto jx = first; jx < last; ++jx) {
+      if (rows.unit()) {
+        auto block = frozen_->segment(cols[jx], rows.start,
+                                      rows.start + rows.length);
+        SPARSE_STAT(cells, block.second - block.first);
+        for (auto kx = block.first; kx < block.second; ++kx) {
+          f(frozen_->indices[kx] - rows.start, jx, frozen_->value(kx));
+        }
+        continue;
+      }
+      auto range = frozen_->segment(cols[jx]);
+      SPARSE_STAT(cells, range.second - range.first);
+      for (auto kx = range.first; kx < range.second; ++kx) {
+        if (rows.position(frozen_->indices[kx], ix)) {
+          f(ix, jx, frozen_->value(kx));
+        }
+      }
+    }
+  }
+
+  // Calls "f(ix, jx, x)" for each entry of the window selected by "rows" and
+  // "cols" held by the tiled storage: only the tiles overlapping the window
+  // are visited, and within them the rows of the window. The tiles are
+  // processed by "threads" threads.
+  template <typename F>
+  auto extract_tiles(const Slice& rows, const Slice& cols, const size_t threads,
+                     const F& f) const -> void {
+    if (rows.length == 0 || cols.length == 0) {
+      return;
+    }
+    // Slices and bounds of the window along the axes of the storage.
+    auto& _rows = ji_ ? cols : rows;
+    auto& _cols = ji_ ? rows : cols;
+    auto bounds = [](const Slice& slice) {
+      auto first = static_cast<I>(slice[0]);
+      auto last = static_cast<I>(slice[slice.length - 1]);
+      return slice.reversed() ? std::make_pair(last, first)
+                              : std::make_pair(first, last);
+    };
+    auto row_bounds = bounds(_rows);
+    auto col_bounds = bounds(_cols);
+    auto tiles = std::vector<size_t>();
+    tiled_->overlap(row_bounds, col_bounds,
+                    [&](const size_t ix) { tiles.push_back(ix); });
+
+    // Rows (or columns) of the bounds lying in a tile, relative to the tile.
+    auto clip = [](const std::pair<I, I>& bounds, const size_t origin) {
+      return std::make_pair(
+          std::max(static_cast<size_t>(bounds.first), origin) - origin,
+          std::min(static_cast<size_t>(bounds.second),
+                   origin + Tiled::kSide - 1) - origin);
+    };
+    parallel_for(
+        tiles.size(), std::min(threads, tiles.size()),
+        [&](const size_t, const size_t first, const size_t last) {
+          dispatch_steps(_rows, _cols, [&](auto unit_rows, auto unit_cols) {
+            size_t ix, jx;
+            for (auto kx = first; kx < last; ++kx) {
+              auto& tile = tiled_->tile(tiles[kx]);
+              SPARSE_STAT(cells, tile.count);
+              auto top = static_cast<size_t>(tile.row) << Tiled::kShift;
+              auto left = static_cast<size_t>(tile.col) << Tiled::kShift;
+              tiled_->visit(
+                  tiles[kx], clip(row_bounds, top), clip(col_bounds, left),
+                  [&](const I i, const I j, const T x) {
+                    if (_rows.locate<unit_rows>(i, ix) &&
+                        _cols.locate<unit_cols>(j, jx)) {
+                      if (ji_) {
+                        f(jx, ix, x);
+                      } else {
+                        f(ix, jx, x);
+                      }
+                    }
+                  });
+            }
+          });
+        });
+  }
+
+  // Number of parts of the storage whose entries are split between the
+  // threads by the kernels: the segments of the snapshot, the tiles of the
+  // tiled storage or the shards of the hash table.
+  auto units_unlocked() const -> size_t {
+    return frozen_ ? frozen_->major() : tiled_ ? tiled_->tiles() : Map::kShards;
+  }
+
+  // Calls "f(i, j, x)" for each entry of the parts [first, last) of a tiled
+  // storage or of a hash table (see "units_unlocked"), indices in the order
+  // of the storage.
+  template <typename F>
+  auto for_each_unit(const size_t first, const size_t last, F&& f) const
+      -> void {
+    for (auto ix = first; ix < last; ++ix) {
+      if (tiled_) {
+        tiled_->visit(ix, {0, Tiled::kSide - 1}, {0, Tiled::kSide - 1}, f);
+        continue;
+      }
+      for (auto& item : data_->shard(ix)) {
+        auto index = Packing<I>::split(item.key);
+        f(index.first, index.second, item.value);
+      }
+    }
+  }
+
   std::shared_ptr<Map> data_{new Map};
-  uint32_t i_ = 0;
-  uint32_t j_ = 0;
+  std::shared_ptr<const Compressed> frozen_;
+  std::shared_ptr<const Tiled> tiled_;
+  // Occupancy filter of the stored keys (see "set_filter"), and its number
+  // of bits per key, 0 if disabled.
+  std::shared_ptr<Filter> filter_;
+  double filter_bits_{0};
+  std::atomic<I> i_{0};
+  std::atomic<I> j_{0};
   bool ji_{false};
+  mutable std::shared_mutex mutex_;
+  // Sorted storages along the rows and the columns of the storage (see
+  // "sorted"), and the versions of the entries they hold.
+  std::atomic<uint64_t> version_{0};
+  mutable std::mutex sorted_mutex_;
+  mutable std::shared_ptr<const Compressed> sorted_[2];
+  mutable uint64_t sorted_version_[2]{0, 0};
+  mutable std::atomic<bool> has_sorted_{false};
+  mutable Stats stats_;
+  mutable std::mutex stats_mutex_;
 };
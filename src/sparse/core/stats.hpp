@@ -0,0 +1,86 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+// Counters of the hot paths: the lookups of the hash tables, their rehashes
+// and the cells visited by the slice reads. They are only maintained if the
+// library is compiled with SPARSE_STATS defined; otherwise the macros below
+// expand to nothing.
+struct Stats {
+  // Lookups of a key in a hash table, the lookups finding the key, and the
+  // slots probed by the lookups.
+  uint64_t lookups{0};
+  uint64_t hits{0};
+  uint64_t probes{0};
+  // Rehashes of the hash tables, and their duration in nanoseconds.
+  uint64_t rehashes{0};
+  uint64_t rehash_ns{0};
+  // Cells (or stored entries) visited by the slice reads, and entries they
+  // returned.
+  uint64_t cells{0};
+  uint64_t returned{0};
+  // Lookups rejected by the occupancy filter of a matrix.
+  uint64_t filtered{0};
+
+  auto operator+=(const Stats& rhs) -> Stats& {
+    lookups += rhs.lookups;
+    hits += rhs.hits;
+    probes += rhs.probes;
+    rehashes += rhs.rehashes;
+    rehash_ns += rhs.rehash_ns;
+    cells += rhs.cells;
+    returned += rhs.returned;
+    filtered += rhs.filtered;
+    return *this;
+  }
+
+  auto operator-(const Stats& rhs) const -> Stats {
+    auto result = *this;
+    result.lookups -= rhs.lookups;
+    result.hits -= rhs.hits;
+    result.probes -= rhs.probes;
+    result.rehashes -= rhs.rehashes;
+    result.rehash_ns -= rhs.rehash_ns;
+    result.cells -= rhs.cells;
+    result.returned -= rhs.returned;
+    result.filtered -= rhs.filtered;
+    return result;
+  }
+};
+
+#ifdef SPARSE_STATS
+inline constexpr bool kStats = true;
+#else
+inline constexpr bool kStats = false;
+#endif
+
+// Counters of the calling thread, updated without synchronization. The
+// parallel kernels merge the counters of their workers into the counters of
+// the calling thread (see "parallel_for").
+inline auto local_stats() -> Stats& {
+  thread_local Stats stats;
+  return stats;
+}
+
+#ifdef SPARSE_STATS
+#define SPARSE_STAT(name, n) (local_stats().name += (n))
+#else
+#define SPARSE_STAT(name, n) static_cast<void>(0)
+#endif
+
+// Measures the duration of a scope into the counter "rehash_ns".
+class RehashTimer {
+ public:
+#ifdef SPARSE_STATS
+  RehashTimer() : start_(std::chrono::steady_clock::now()) {}
+  ~RehashTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    local_stats().rehashes += 1;
+    local_stats().rehash_ns += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+#endif
+};
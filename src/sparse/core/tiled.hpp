@@ -0,0 +1,349 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "types.hpp"
+
+// Read-only storage grouping the entries into square tiles of kSide x kSide
+// cells, sorted in Morton (Z) order of their coordinates: the tiles covering
+// a window are close to each other in memory, and the entries of a tile are
+// contiguous. Each tile is stored in one of three forms, chosen by its
+// number of entries:
+//
+// - list: the sorted positions of the entries in the tile, and their values;
+// - bitmap: one bit per cell, and the values of the entries;
+// - dense: one bit per cell, and the values of all the cells.
+//
+// The storage of a boolean matrix holds no values.
+template <typename T, typename I = uint32_t>
+class Tiled {
+ public:
+  using Key = typename Packing<I>::Key;
+
+  static constexpr bool kPattern = std::is_same<T, bool>::value;
+
+  // log2 of the side of a tile.
+  static constexpr size_t kShift = 6;
+  static constexpr size_t kSide = size_t(1) << kShift;
+  static constexpr size_t kCells = kSide * kSide;
+
+  enum Kind : uint8_t { kList, kBitmap, kDense };
+
+  struct Tile {
+    // Coordinates of the tile: the indices of its cells shifted by kShift.
+    I row;
+    I col;
+    Kind kind;
+    uint32_t count;
+    // Position of the first value of the tile in "data", and of its first
+    // position in "positions" (list) or of its first row in "bitmaps".
+    uint64_t offset;
+    uint64_t extra;
+  };
+
+  // Builds the storage of "size" entries, "visit(f)" calling "f(key, value)"
+  // for each entry, keys packed by "Packing<I>".
+  template <typename Visitor>
+  static auto build(const size_t size, const Visitor& visit) -> Tiled {
+    struct Item {
+      I row;
+      I col;
+      uint16_t position;
+      Storage<T> value;
+    };
+    auto items = std::vector<Item>();
+    items.reserve(size);
+    visit([&](const Key& key, const T value) {
+      auto index = Packing<I>::split(key);
+      items.push_back({static_cast<I>(index.first >> kShift),
+                       static_cast<I>(index.second >> kShift),
+                       Tiled::position(index.first, index.second),
+                       static_cast<Storage<T>>(value)});
+    });
+    std::sort(items.begin(), items.end(), [](const Item& lhs, const Item& rhs) {
+      if (lhs.row != rhs.row || lhs.col != rhs.col) {
+        return Tiled::precedes(lhs.row, lhs.col, rhs.row, rhs.col);
+      }
+      return lhs.position < rhs.position;
+    });
+
+    auto result = Tiled();
+    result.size_ = items.size();
+    for (size_t first = 0; first < items.size();) {
+      auto last = first + 1;
+      while (last < items.size() && items[last].row == items[first].row &&
+             items[last].col == items[first].col) {
+        ++last;
+      }
+      auto count = last - first;
+      auto tile = Tile{items[first].row, items[first].col, kind(count),
+                       static_cast<uint32_t>(count), result.data_.size(), 0};
+      if (tile.kind == kList) {
+        tile.extra = result.positions_.size();
+        for (auto ix = first; ix < last; ++ix) {
+          result.positions_.push_back(items[ix].position);
+        }
+      } else {
+        tile.extra = result.bitmaps_.size();
+        result.bitmaps_.resize(result.bitmaps_.size() + kSide, 0);
+        result.ranks_.resize(result.ranks_.size() + kSide, 0);
+        auto* words = &result.bitmaps_[tile.extra];
+        for (auto ix = first; ix < last; ++ix) {
+          auto position = items[ix].position;
+          words[position >> kShift] |= uint64_t(1) << (position & (kSide - 1));
+        }
+        auto* ranks = &result.ranks_[tile.extra];
+        for (size_t row = 1; row < kSide; ++row) {
+          ranks[row] = static_cast<uint16_t>(
+              ranks[row - 1] + Tiled::popcount(words[row - 1]));
+        }
+      }
+      if constexpr (!kPattern) {
+        if (tile.kind == kDense) {
+          result.data_.resize(result.data_.size() + kCells, T(0));
+          for (auto ix = first; ix < last; ++ix) {
+            result.data_[tile.offset + items[ix].position] = items[ix].value;
+          }
+        } else {
+          for (auto ix = first; ix < last; ++ix) {
+            result.data_.push_back(items[ix].value);
+          }
+        }
+      }
+      result.tiles_.push_back(tile);
+      first = last;
+    }
+    return result;
+  }
+
+  // Number of entries.
+  auto size() const -> size_t { return size_; }
+
+  // Number of tiles holding at least one entry.
+  auto tiles() const -> size_t { return tiles_.size(); }
+
+  // Copies the value of the entry (i, j) into "value". Returns false if the
+  // entry is not stored.
+  auto find(const I i, const I j, T& value) const -> bool {
+    auto row = static_cast<I>(i >> kShift);
+    auto col = static_cast<I>(j >> kShift);
+    auto it = search(tiles_.begin(), tiles_.end(), row, col);
+    if (it == tiles_.end() || it->row != row || it->col != col) {
+      return false;
+    }
+    auto& tile = *it;
+    auto position = Tiled::position(i, j);
+    auto kx = size_t(0);
+    if (tile.kind == kList) {
+      auto first = positions_.begin() + tile.extra;
+      auto last = first + tile.count;
+      auto found = std::lower_bound(first, last, position);
+      if (found == last || *found != position) {
+        return false;
+      }
+      kx = static_cast<size_t>(found - first);
+    } else {
+      auto word = bitmaps_[tile.extra + (position >> kShift)];
+      auto bit = position & (kSide - 1);
+      if (((word >> bit) & 1) == 0) {
+        return false;
+      }
+      kx = tile.kind == kDense
+               ? position
+               : ranks_[tile.extra + (position >> kShift)] +
+                     Tiled::popcount(word & ((uint64_t(1) << bit) - 1));
+    }
+    value = this->value(tile, kx);
+    return true;
+  }
+
+  // Calls "f(i, j, x)" for each entry, in storage order.
+  template <typename F>
+  auto for_each(F&& f) const -> void {
+    for (size_t ix = 0; ix < tiles_.size(); ++ix) {
+      visit(ix, {0, kSide - 1}, {0, kSide - 1}, f);
+    }
+  }
+
+  // Calls "f(i, j, x)" for each entry of the tile "ix" whose position in the
+  // tile lies in the rows and columns [first, second] of "rows" and "cols".
+  template <typename F>
+  auto visit(const size_t ix, const std::pair<size_t, size_t>& rows,
+             const std::pair<size_t, size_t>& cols, F&& f) const -> void {
+    auto& tile = tiles_[ix];
+    auto i = static_cast<I>(tile.row) << kShift;
+    auto j = static_cast<I>(tile.col) << kShift;
+    if (tile.kind == kList) {
+      auto* positions = &positions_[tile.extra];
+      for (size_t kx = 0; kx < tile.count; ++kx) {
+        auto row = size_t(positions[kx] >> kShift);
+        auto col = size_t(positions[kx] & (kSide - 1));
+        if (row >= rows.first && row <= rows.second && col >= cols.first &&
+            col <= cols.second) {
+          f(static_cast<I>(i + row), static_cast<I>(j + col), value(tile, kx));
+        }
+      }
+      return;
+    }
+    // Bits of the selected columns.
+    auto mask = (~uint64_t(0) >> (kSide - 1 - cols.second)) &
+                (~uint64_t(0) << cols.first);
+    auto* words = &bitmaps_[tile.extra];
+    auto* ranks = &ranks_[tile.extra];
+    for (auto row = rows.first; row <= rows.second; ++row) {
+      auto word = words[row] & mask;
+      while (word != 0) {
+        auto col = Tiled::lowest_bit(word);
+        word &= word - 1;
+        auto below = words[row] & ((uint64_t(1) << col) - 1);
+        auto kx = tile.kind == kDense ? (row << kShift) + col
+                                      : ranks[row] + Tiled::popcount(below);
+        f(static_cast<I>(i + row), static_cast<I>(j + col), value(tile, kx));
+      }
+    }
+  }
+
+  // Calls "f(ix)" for each tile "ix" holding cells of the rectangle of rows
+  // [rows.first, rows.second] and columns [cols.first, cols.second]. The
+  // Morton codes of these tiles lie between the codes of the corners of the
+  // rectangle: the tiles are either searched one by one, or found by
+  // scanning the tiles between the corners, whichever is cheaper.
+  template <typename F>
+  auto overlap(const std::pair<I, I>& rows, const std::pair<I, I>& cols,
+               F&& f) const -> void {
+    auto top = static_cast<I>(rows.first >> kShift);
+    auto bottom = static_cast<I>(rows.second >> kShift);
+    auto left = static_cast<I>(cols.first >> kShift);
+    auto right = static_cast<I>(cols.second >> kShift);
+    auto begin = search(tiles_.begin(), tiles_.end(), top, left);
+    auto end = std::upper_bound(
+        begin, tiles_.end(), std::make_pair(bottom, right),
+        [](const std::pair<I, I>& lhs, const Tile& rhs) {
+          return Tiled::precedes(lhs.first, lhs.second, rhs.row, rhs.col);
+        });
+    auto length = static_cast<size_t>(end - begin);
+    auto depth = size_t(1);
+    for (auto k = length; k != 0; k >>= 1) {
+      ++depth;
+    }
+    auto height = size_t(bottom - top) + 1;
+    auto width = size_t(right - left) + 1;
+    if (height <= length / depth / width) {
+      for (auto row = top;; ++row) {
+        for (auto col = left;; ++col) {
+          auto it = search(begin, end, row, col);
+          if (it != end && it->row == row && it->col == col) {
+            f(static_cast<size_t>(it - tiles_.begin()));
+          }
+          if (col == right) {
+            break;
+          }
+        }
+        if (row == bottom) {
+          break;
+        }
+      }
+      return;
+    }
+    for (auto it = begin; it != end; ++it) {
+      if (it->row >= top && it->row <= bottom && it->col >= left &&
+          it->col <= right) {
+        f(static_cast<size_t>(it - tiles_.begin()));
+      }
+    }
+  }
+
+  auto tile(const size_t ix) const -> const Tile& { return tiles_[ix]; }
+
+  auto memory_usage() const -> size_t {
+    return tiles_.size() * sizeof(Tile) +
+           positions_.size() * sizeof(uint16_t) +
+           bitmaps_.size() * sizeof(uint64_t) +
+           ranks_.size() * sizeof(uint16_t) + data_.size() * sizeof(T);
+  }
+
+ private:
+  // Number of bits set in "word".
+  static auto popcount(const uint64_t word) -> size_t {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<size_t>(__builtin_popcountll(word));
+#else
+    auto result = size_t(0);
+    for (auto bits = word; bits != 0; bits &= bits - 1) {
+      ++result;
+    }
+    return result;
+#endif
+  }
+
+  // Index of the lowest bit set in "word", which is not 0.
+  static auto lowest_bit(const uint64_t word) -> size_t {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<size_t>(__builtin_ctzll(word));
+#else
+    auto result = size_t(0);
+    for (auto bits = word; (bits & 1) == 0; bits >>= 1) {
+      ++result;
+    }
+    return result;
+#endif
+  }
+
+  // Form of a tile holding "count" entries: the list of the positions of the
+  // entries as long as it is smaller than a bitmap, the dense form once the
+  // entries fill half of the cells.
+  static auto kind(const size_t count) -> Kind {
+    if (count * sizeof(uint16_t) < kSide * sizeof(uint64_t)) {
+      return kList;
+    }
+    return !kPattern && count * 2 >= kCells ? kDense : kBitmap;
+  }
+
+  // Position of the cell (i, j) in its tile, in row-major order.
+  static auto position(const I i, const I j) -> uint16_t {
+    return static_cast<uint16_t>(((i & (kSide - 1)) << kShift) |
+                                 (j & (kSide - 1)));
+  }
+
+  // Z-order of two tiles: the coordinate whose most significant differing
+  // bit is the highest decides, the bits of the rows being interleaved above
+  // the bits of the columns.
+  static auto precedes(const I lhs_row, const I lhs_col, const I rhs_row,
+                       const I rhs_col) -> bool {
+    auto rows = static_cast<I>(lhs_row ^ rhs_row);
+    auto cols = static_cast<I>(lhs_col ^ rhs_col);
+    if (rows < cols && rows < static_cast<I>(rows ^ cols)) {
+      return lhs_col < rhs_col;
+    }
+    return lhs_row < rhs_row;
+  }
+
+  template <typename It>
+  static auto search(const It first, const It last, const I row, const I col)
+      -> It {
+    return std::lower_bound(first, last, std::make_pair(row, col),
+                            [](const Tile& lhs, const std::pair<I, I>& rhs) {
+                              return Tiled::precedes(lhs.row, lhs.col,
+                                                     rhs.first, rhs.second);
+                            });
+  }
+
+  // Value stored at the position "kx" of a tile.
+  auto value(const Tile& tile, const size_t kx) const -> T {
+    if constexpr (kPattern) {
+      return true;
+    } else {
+      return data_[tile.offset + kx];
+    }
+  }
+
+  size_t size_{0};
+  std::vector<Tile> tiles_;
+  std::vector<uint16_t> positions_;
+  std::vector<uint64_t> bitmaps_;
+  std::vector<uint16_t> ranks_;
+  std::vector<Storage<T>> data_;
+};
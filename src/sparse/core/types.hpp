@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// Key packing two 64-bit indices.
+struct Key128 {
+  uint64_t high;
+  uint64_t low;
+
+  auto operator==(const Key128& rhs) const -> bool {
+    return high == rhs.high && low == rhs.low;
+  }
+  auto operator!=(const Key128& rhs) const -> bool { return !(*this == rhs); }
+  auto operator<(const Key128& rhs) const -> bool {
+    return high < rhs.high || (high == rhs.high && low < rhs.low);
+  }
+};
+
+// Cheap integer mixer (finalizer of MurmurHash3).
+inline auto hash_key(uint64_t key) -> uint64_t {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+inline auto hash_key(const Key128& key) -> uint64_t {
+  return hash_key(key.low ^ hash_key(key.high));
+}
+
+// Key with all its bits set, marking the empty slots of the hash tables.
+template <typename K>
+constexpr auto empty_key() -> K {
+  return ~K(0);
+}
+
+template <>
+constexpr auto empty_key<Key128>() -> Key128 {
+  return {~uint64_t(0), ~uint64_t(0)};
+}
+
+// Packing of the (row, column) indices of an entry into a single key: a
+// 64-bit integer for indices of up to 32 bits, a Key128 otherwise.
+template <typename I>
+struct Packing {
+  static_assert(std::is_unsigned<I>::value && sizeof(I) <= 8,
+                "indices must be unsigned integers of at most 64 bits");
+
+  using Key = std::conditional_t<(sizeof(I) <= 4), uint64_t, Key128>;
+
+  static auto pack(const I i, const I j) -> Key {
+    if constexpr (sizeof(I) <= 4) {
+      return (static_cast<uint64_t>(i) << 32) | j;
+    } else {
+      return {i, j};
+    }
+  }
+
+  static auto split(const Key& key) -> std::pair<I, I> {
+    if constexpr (sizeof(I) <= 4) {
+      return {static_cast<I>(key >> 32), static_cast<I>(key)};
+    } else {
+      return {key.high, key.low};
+    }
+  }
+};
+
+// Type used to exchange values of type T through buffers: booleans are
+// exchanged as bytes, std::vector<bool> being a bitset.
+template <typename T>
+using Storage = std::conditional_t<std::is_same<T, bool>::value, uint8_t, T>;
+
+// NumPy code of a type: its kind followed by its size in bytes ("f8", "u4",
+// "b1", ...).
+template <typename T>
+auto type_code() -> std::string {
+  static_assert(std::is_arithmetic<T>::value, "unsupported type");
+  auto kind = std::is_same<T, bool>::value         ? 'b'
+              : std::is_floating_point<T>::value ? 'f'
+              : std::is_signed<T>::value         ? 'i'
+                                                 : 'u';
+  return std::string(1, kind) + std::to_string(sizeof(T));
+}